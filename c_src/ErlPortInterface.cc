@@ -4,6 +4,7 @@
  */
 
 #include "ErlPortInterface.h"
+#include "PortStats.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -12,13 +13,28 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
 
 typedef unsigned char byte;
 
-int read_exact(byte *buf, int len);
-int write_exact(byte *buf, int len);
-int read_cmd(byte *buf);
-int write_cmd(byte *buf, int len);
+enum MessageType
+{
+    MSG_BEST_VALUE = 1,
+    MSG_RESULT = 2,
+    MSG_INCUMBENT = 3,
+    MSG_HELLO = 4,
+    MSG_SOLUTION = 5,
+    MSG_BEST_SOLUTION = 6,
+    MSG_EXPORT_REQUEST = 7,
+    MSG_EXPORTED_NODES = 8,
+    MSG_JOB = 9,
+    MSG_JOB_RESULT = 10,
+    MSG_PROGRESS = 11,
+    MSG_CANCEL = 12,
+    MSG_STATS = 13
+    // ErlPortInterface::NUM_MESSAGE_TYPES is one past the last
+};
 
 bool isBetter(double oldVal, double newVal)
 {
@@ -35,7 +51,42 @@ void writeDouble(byte *buf, double val)
     }
 }
 
-double readDouble(byte *buf)
+void appendDouble(std::vector<byte> &buf, double val)
+{
+    buf.resize(buf.size() + 8);
+    writeDouble(&(buf[buf.size() - 8]), val);
+}
+
+void appendUInt32(std::vector<byte> &buf, unsigned val)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        buf.push_back((val >> shift) & 0xFF);
+    }
+}
+
+void appendUInt64(std::vector<byte> &buf, unsigned long long val)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+    {
+        buf.push_back((val >> shift) & 0xFF);
+    }
+}
+
+unsigned readUInt32(const byte *buf)
+{
+    return ((unsigned)buf[0] << 24) | ((unsigned)buf[1] << 16)
+        | ((unsigned)buf[2] << 8) | buf[3];
+}
+
+static double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+double readDouble(const byte *buf)
 {
     unsigned long long l = buf[0];
     for (size_t i = 1; i < 8; ++i)
@@ -49,9 +100,32 @@ double readDouble(byte *buf)
 ErlPortInterface::ErlPortInterface()
 {
     _state = BV_NONE;
+    _erlSeq = 0;
+    _exportRequest = 0;
+    _cancelMark = 0;
+    _numJobsReceived = 0;
+    _currentJob = 0;
     _bEnabled = false;
     _quiet = false;
+    _protocol = 1;
+    _numVars = -1;
+    _bestSource = 0;
+    _hasPending = false;
+    _sending = false;
+    _pendingValue = 0;
+    _publishInterval = 0;
+    _closed = false;
+    _server = false;
+    _inputClosed = false;
+    _progressInterval = 10;
+    _nextProgress = 0;
+    _progressChanged = false;
+    _sendStats = false;
     pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_hasJob, NULL);
+    pthread_mutex_init(&_writeMutex, NULL);
+    pthread_cond_init(&_hasIncumbent, NULL);
+    pthread_cond_init(&_incumbentSent, NULL);
 }
 
 void ErlPortInterface::setQuiet(bool quiet)
@@ -59,87 +133,91 @@ void ErlPortInterface::setQuiet(bool quiet)
     _quiet = quiet;
 }
 
-void ErlPortInterface::writeResult(const std::string &status, double bestValue)
+void ErlPortInterface::setPublishInterval(double seconds)
 {
-    char buf[100];
-    buf[0] = 2;
-    char *p = buf + 1;
-    writeDouble((byte *)p, bestValue);
-    p += 8;
-
-    sprintf(p, "%s", status.c_str());
-    
-    if (!_quiet)
-    {
-        fprintf(stderr, ">>> sendResult: %lf, %s\n", bestValue, p);
-    }
-    if (_bEnabled)
-    {
-        write_cmd((byte *)buf, p - buf + strlen(p));
-    }
+    _publishInterval = seconds;
 }
 
-int read_cmd(byte *buf)
+// The length is 2 bytes in protocol 1 and 4 bytes since protocol 2
+void ErlPortInterface::setProtocol(int version)
 {
-    int len;
-
-    if (read_exact(buf, 2) != 2)
-        return(-1);
-    len = (buf[0] << 8) | buf[1];
-    return read_exact(buf, len);
+    _protocol = version;
+    _channel.setLengthBytes(version < 2 ? 2 : 4);
 }
 
-int write_cmd(byte *buf, int len)
+void ErlPortInterface::setNumVars(int numVars)
 {
-    byte li;
-
-    li = (len >> 8) & 0xff;
-    write_exact(&li, 1);
-  
-    li = len & 0xff;
-    write_exact(&li, 1);
+    _numVars = numVars;
+}
 
-    return write_exact(buf, len);
+void ErlPortInterface::setSendStats(bool sendStats)
+{
+    _sendStats = sendStats;
 }
 
-int read_exact(byte *buf, int len)
+void ErlPortInterface::writeResult(const std::string &status, double bestValue)
 {
-    int i, got=0;
+    // The result goes last, after the incumbent it may still be holding
+    // and the final progress
+    flushIncumbent();
+    flushProgress();
 
-    do {
-        if ((i = read(3, buf+got, len-got)) <= 0)
+    if (!_quiet)
+    {
+        fprintf(stderr, ">>> sendResult: %lf, %s\n", bestValue, status.c_str());
+    }
+    if (_bEnabled)
+    {
+        pthread_mutex_lock(&_writeMutex);
+        // <<13, Stats/binary>>, the JSON line printed at exit so far
+        if (_sendStats && _protocol >= 2)
         {
-            return(i);
+            std::string stats(formatPortStats());
+            std::vector<byte> &statsBuf = _buffers[MSG_STATS];
+            statsBuf.clear();
+            statsBuf.push_back(MSG_STATS);
+            statsBuf.insert(statsBuf.end(), stats.begin(), stats.end());
+            writeMessage(statsBuf);
         }
-        got += i;
-    } while (got<len);
-
-    return(len);
+        std::vector<byte> &buf = _buffers[MSG_RESULT];
+        buf.clear();
+        buf.push_back(MSG_RESULT);
+        appendDouble(buf, bestValue);
+        buf.insert(buf.end(), status.begin(), status.end());
+        writeMessage(buf);
+        _closed = true;
+        pthread_mutex_unlock(&_writeMutex);
+        // The process may exit right after the result, the reader has
+        // nothing left to wait for
+        _channel.flush();
+        _channel.shutdown();
+    }
 }
 
-int write_exact(byte *buf, int len)
+int ErlPortInterface::readMessage(std::vector<byte> &buf)
 {
-    int i, wrote = 0;
-
-    do {
-        if ((i = write(4, buf+wrote, len-wrote)) <= 0)
-            return (i);
-        wrote += i;
-    } while (wrote<len);
+    return _channel.read(buf);
+}
 
-    return (len);
+// Called with _writeMutex held, buf gets a recycled buffer back
+void ErlPortInterface::writeMessage(std::vector<byte> &buf)
+{
+    countPortEvent(STAT_MESSAGES_SENT);
+    countPortEvent(STAT_BYTES_SENT, buf.size());
+    PortTimerScope timer(TIMER_SEND);
+    _channel.send(buf);
 }
 
 void *ErlPortInterface::readerLoop(void *ptr)
 {
     ErlPortInterface *This = (ErlPortInterface *)ptr;
 
-    byte buf[100];
+    std::vector<byte> buf;
     int len = 0;
-    while ((len = read_cmd(buf)) > 0) {
+    while ((len = This->readMessage(buf)) > 0) {
         switch (buf[0])
         {
-        case 1:
+        case MSG_BEST_VALUE:
             if (len != 9)
             {
                 fprintf(stderr, ">>> Wrong input message size: %d != 9\n", len);
@@ -148,71 +226,574 @@ void *ErlPortInterface::readerLoop(void *ptr)
             if (!This->_quiet)
             {
                 fprintf(stderr, ">>> readerLoop(): received best solution: %lf\n",
-                    readDouble(buf + 1));
+                    readDouble(&(buf[1])));
+            }
+            This->setBestValue(readDouble(&(buf[1])), false);
+            break;
+        case MSG_BEST_SOLUTION:
+            This->receiveSolution(buf, len);
+            break;
+        case MSG_EXPORT_REQUEST:
+            if (len != 5)
+            {
+                fprintf(stderr, ">>> Wrong input message size: %d != 5\n", len);
+                exit(1);
             }
-            This->setBestValue(readDouble(buf + 1), false);
+            if (!This->_quiet)
+            {
+                fprintf(stderr, ">>> readerLoop(): asked for %u open nodes\n",
+                    readUInt32(&(buf[1])));
+            }
+            __atomic_store_n(&This->_exportRequest, (int)readUInt32(&(buf[1])),
+                __ATOMIC_RELEASE);
+            break;
+        case MSG_JOB:
+            if (len < 5)
+            {
+                fprintf(stderr, ">>> Wrong input message size: %d < 5\n", len);
+                exit(1);
+            }
+            pthread_mutex_lock(&This->_mutex);
+            ++This->_numJobsReceived;
+            This->_jobs.push_back(std::make_pair(readUInt32(&(buf[1])),
+                    std::string(buf.begin() + 5, buf.begin() + len)));
+            pthread_cond_signal(&This->_hasJob);
+            pthread_mutex_unlock(&This->_mutex);
+            break;
+        case MSG_CANCEL:
+            if (!This->_quiet)
+            {
+                fprintf(stderr, ">>> readerLoop(): asked to cancel\n");
+            }
+            pthread_mutex_lock(&This->_mutex);
+            __atomic_store_n(&This->_cancelMark, This->_numJobsReceived + 1,
+                __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&This->_mutex);
             break;
         }
     }
-    fprintf(stderr, ">>> read_cmd() failed: %d\n", len);
-    exit(2);
+    // The end of input, a failed read or shutdown() after the result. A
+    // server is done after the last job, a solve is cancelled so the
+    // solvers stop and leave their solution and checkpoint behind.
+    pthread_mutex_lock(&This->_writeMutex);
+    bool closed = This->_closed;
+    pthread_mutex_unlock(&This->_writeMutex);
+    pthread_mutex_lock(&This->_mutex);
+    This->_inputClosed = true;
+    if (!This->_server)
+    {
+        if (!closed)
+        {
+            fprintf(stderr, ">>> readMessage() failed: %d, cancelling the solve\n", len);
+        }
+        __atomic_store_n(&This->_cancelMark, This->_numJobsReceived + 1,
+            __ATOMIC_RELEASE);
+    }
+    pthread_cond_signal(&This->_hasJob);
+    pthread_mutex_unlock(&This->_mutex);
+    return NULL;
+}
+
+// <<6, Value/float, Count:32, (Index:32, X/float)*Count>>, the same sparse
+// encoding as the solutions sent
+void ErlPortInterface::receiveSolution(const std::vector<byte> &buf, int len)
+{
+    // Sizes in size_t, so that a huge count cannot wrap 13 + 12 * count
+    unsigned count = len >= 13 ? readUInt32(&(buf[9])) : 0;
+    if (len < 13 || count > (size_t)(len - 13) / 12
+        || (size_t)len != 13 + 12 * (size_t)count)
+    {
+        fprintf(stderr, ">>> Wrong solution message size: %d\n", len);
+        exit(1);
+    }
+    double value = readDouble(&(buf[1]));
+    if (!_quiet)
+    {
+        fprintf(stderr, ">>> readerLoop(): received best solution: %lf, %u nonzeros\n",
+            value, count);
+    }
+    if (_numVars <= 0)
+    {
+        setBestValue(value, false);
+        return;
+    }
+
+    std::vector<double> x(_numVars, 0.);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const byte *p = &(buf[13 + 12 * i]);
+        unsigned index = readUInt32(p);
+        if (index >= x.size())
+        {
+            fprintf(stderr, ">>> Variable %u out of range in solution\n", index);
+            exit(1);
+        }
+        x[index] = readDouble(p + 4);
+    }
+    setBest(value, false, &(x[0]), x.size(), 0);
+}
+
+void *ErlPortInterface::publisherLoop(void *ptr)
+{
+    ErlPortInterface *This = (ErlPortInterface *)ptr;
+
+    while (true)
+    {
+        pthread_mutex_lock(&This->_mutex);
+        while (!This->_hasPending)
+        {
+            pthread_cond_wait(&This->_hasIncumbent, &This->_mutex);
+        }
+        double value = This->_pendingValue;
+        std::vector<double> solution;
+        solution.swap(This->_pendingSolution);
+        This->_hasPending = false;
+        This->_sending = true;
+        pthread_mutex_unlock(&This->_mutex);
+
+        This->sendIncumbent(value, solution);
+
+        pthread_mutex_lock(&This->_mutex);
+        This->_sending = false;
+        pthread_cond_broadcast(&This->_incumbentSent);
+        pthread_mutex_unlock(&This->_mutex);
+
+        // Improvements found meanwhile are coalesced into the next one
+        if (This->_publishInterval > 0)
+        {
+            usleep((useconds_t)(This->_publishInterval * 1e6));
+        }
+    }
+    return NULL;
+}
+
+// Called with _mutex held
+void ErlPortInterface::publishIncumbent(double value, const double *x, int n)
+{
+    if (!_bEnabled)
+    {
+        sendIncumbent(value, std::vector<double>());
+        return;
+    }
+    _pendingValue = value;
+    // Solver columns past the problem's ones are its own auxiliaries
+    if (_protocol >= 2 && x != NULL && _numVars > 0 && n >= _numVars)
+    {
+        _pendingSolution.assign(x, x + _numVars);
+    }
+    else
+    {
+        _pendingSolution.clear();
+    }
+    _hasPending = true;
+    pthread_cond_signal(&_hasIncumbent);
+}
+
+// Also waits for the incumbent the publisher is sending, so that a result
+// written next comes after it
+void ErlPortInterface::flushIncumbent()
+{
+    pthread_mutex_lock(&_mutex);
+    while (_sending)
+    {
+        pthread_cond_wait(&_incumbentSent, &_mutex);
+    }
+    bool hasPending = _hasPending;
+    double value = _pendingValue;
+    std::vector<double> solution;
+    solution.swap(_pendingSolution);
+    _hasPending = false;
+    pthread_mutex_unlock(&_mutex);
+
+    if (hasPending)
+    {
+        sendIncumbent(value, solution);
+    }
 }
 
-void ErlPortInterface::sendIncumbent(double value)
+// The solution goes as <<5, Value/float, Count:32, (Index:32, X/float)*Count>>
+// with the nonzeros only, an empty one makes it a plain <<3, Value/float>>
+void ErlPortInterface::sendIncumbent(double value,
+    const std::vector<double> &solution)
 {
     if (!_quiet)
     {
         fprintf(stderr, ">>> sendIncumbent(): %lf\n", value);
     }
+    if (!_bEnabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&_writeMutex);
+    if (!_closed)
+    {
+        std::vector<byte> &buf = _buffers[solution.empty() ? MSG_INCUMBENT : MSG_SOLUTION];
+        buf.clear();
+        if (solution.empty())
+        {
+            buf.push_back(MSG_INCUMBENT);
+            appendDouble(buf, value);
+        }
+        else
+        {
+            unsigned numNonzeros = 0;
+            for (size_t i = 0; i < solution.size(); ++i)
+            {
+                numNonzeros += solution[i] != 0.;
+            }
+            buf.reserve(1 + 8 + 4 + 12 * numNonzeros);
+            buf.push_back(MSG_SOLUTION);
+            appendDouble(buf, value);
+            appendUInt32(buf, numNonzeros);
+            for (size_t i = 0; i < solution.size(); ++i)
+            {
+                if (solution[i] != 0.)
+                {
+                    appendUInt32(buf, i);
+                    appendDouble(buf, solution[i]);
+                }
+            }
+        }
+        countPortEvent(STAT_INCUMBENTS_SENT);
+        writeMessage(buf);
+    }
+    pthread_mutex_unlock(&_writeMutex);
+}
+
+void ErlPortInterface::setServer(bool server)
+{
+    _server = server;
+}
+
+bool ErlPortInterface::waitJob(unsigned &id, std::string &job)
+{
+    pthread_mutex_lock(&_mutex);
+    while (_jobs.empty() && !_inputClosed)
+    {
+        pthread_cond_wait(&_hasJob, &_mutex);
+    }
+    bool result = !_jobs.empty();
+    if (result)
+    {
+        id = _jobs.front().first;
+        job = _jobs.front().second;
+        _jobs.pop_front();
+        ++_currentJob;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return result;
+}
+
+// <<10, Id:32, Value/float, Status/binary>>
+void ErlPortInterface::writeJobResult(unsigned id, const std::string &status,
+    double bestValue)
+{
+    // After the incumbents and the progress of the job
+    flushIncumbent();
+    flushProgress();
+
+    if (!_quiet)
+    {
+        fprintf(stderr, ">>> sendJobResult: %u, %lf, %s\n", id, bestValue,
+            status.c_str());
+    }
+    if (_bEnabled)
+    {
+        pthread_mutex_lock(&_writeMutex);
+        std::vector<byte> &buf = _buffers[MSG_JOB_RESULT];
+        buf.clear();
+        buf.push_back(MSG_JOB_RESULT);
+        appendUInt32(buf, id);
+        appendDouble(buf, bestValue);
+        buf.insert(buf.end(), status.begin(), status.end());
+        writeMessage(buf);
+        pthread_mutex_unlock(&_writeMutex);
+    }
+}
+
+void ErlPortInterface::setProgressInterval(double seconds)
+{
+    _progressInterval = seconds;
+}
+
+/// The progress slot of the solver this thread reported for last
+static __thread unsigned t_progressId = 0;
+static __thread void *t_progressSlot = NULL;
+
+// Every solver writes its own slot without the mutex, which is only taken
+// for the first report of a solver and when a message is due
+void ErlPortInterface::reportProgress(const BestValueAcceptor &source,
+    double dualBound, long long nodes, long long openNodes)
+{
+    if (_protocol < 2 || _progressInterval <= 0)
+    {
+        return;
+    }
+
+    if (t_progressId != source._id || t_progressSlot == NULL)
+    {
+        // Map nodes stay where they are, the slot outlives the solver
+        pthread_mutex_lock(&_mutex);
+        t_progressSlot = &_progress[source._id];
+        pthread_mutex_unlock(&_mutex);
+        t_progressId = source._id;
+    }
+    Progress *progress = (Progress *)t_progressSlot;
+    __atomic_store(&progress->dualBound, &dualBound, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->nodes, nodes, __ATOMIC_RELAXED);
+    __atomic_store_n(&progress->openNodes, openNodes, __ATOMIC_RELAXED);
+    __atomic_store_n(&_progressChanged, true, __ATOMIC_RELEASE);
+
+    double now = getTime();
+    double next;
+    __atomic_load(&_nextProgress, &next, __ATOMIC_RELAXED);
+    if (now < next)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    unsigned long long locked = portClockNs();
+    // Another solver may have sent it meanwhile
+    bool due = now >= _nextProgress;
+    Progress total;
+    if (due)
+    {
+        next = now + _progressInterval;
+        __atomic_store(&_nextProgress, &next, __ATOMIC_RELAXED);
+        total = takeProgress();
+    }
+    recordPortTime(TIMER_MUTEX_HOLD, portClockNs() - locked);
+    pthread_mutex_unlock(&_mutex);
+
+    if (due)
+    {
+        sendProgress(total);
+    }
+}
+
+// Called with _mutex held, the slots are written without it
+ErlPortInterface::Progress ErlPortInterface::takeProgress()
+{
+    Progress total;
+    total.dualBound = 1e23;
+    total.nodes = 0;
+    total.openNodes = 0;
+    __atomic_store_n(&_progressChanged, false, __ATOMIC_RELAXED);
+    for (std::map<unsigned, Progress>::iterator it = _progress.begin();
+         it != _progress.end(); ++it)
+    {
+        double dualBound;
+        __atomic_load(&it->second.dualBound, &dualBound, __ATOMIC_RELAXED);
+        total.dualBound = std::min(total.dualBound, dualBound);
+        total.nodes += __atomic_load_n(&it->second.nodes, __ATOMIC_RELAXED);
+        total.openNodes += __atomic_load_n(&it->second.openNodes, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void ErlPortInterface::flushProgress()
+{
+    pthread_mutex_lock(&_mutex);
+    bool changed = __atomic_load_n(&_progressChanged, __ATOMIC_ACQUIRE);
+    Progress total;
+    if (changed)
+    {
+        total = takeProgress();
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    if (changed)
+    {
+        sendProgress(total);
+    }
+}
+
+// <<11, DualBound/float, Nodes:64, OpenNodes:64>>
+void ErlPortInterface::sendProgress(const Progress &total)
+{
+    if (!_quiet)
+    {
+        fprintf(stderr, ">>> sendProgress: %lf, %lld nodes, %lld open\n",
+            total.dualBound, total.nodes, total.openNodes);
+    }
     if (_bEnabled)
     {
-        byte buf[1 + 8];
-        buf[0] = 3;
-        writeDouble(buf + 1, value);
-        write_cmd(buf, sizeof(buf));
+        pthread_mutex_lock(&_writeMutex);
+        if (!_closed)
+        {
+            std::vector<byte> &buf = _buffers[MSG_PROGRESS];
+            buf.clear();
+            buf.push_back(MSG_PROGRESS);
+            appendDouble(buf, total.dualBound);
+            appendUInt64(buf, total.nodes);
+            appendUInt64(buf, total.openNodes);
+            countPortEvent(STAT_PROGRESS_SENT);
+            writeMessage(buf);
+        }
+        pthread_mutex_unlock(&_writeMutex);
+    }
+}
+
+// <<12>>, outside server mode _currentJob stays 0 and any cancel counts
+bool ErlPortInterface::isCancelled() const
+{
+    return _currentJob < __atomic_load_n(&_cancelMark, __ATOMIC_ACQUIRE);
+}
+
+int ErlPortInterface::takeExportRequest()
+{
+    if (__atomic_load_n(&_exportRequest, __ATOMIC_ACQUIRE) == 0)
+    {
+        return 0;
+    }
+    return __atomic_exchange_n(&_exportRequest, 0, __ATOMIC_ACQ_REL);
+}
+
+// <<8, Count:32, (Length:32, Delta/binary)*Count>>, an empty list if the
+// solver can't give up nodes
+void ErlPortInterface::sendExportedNodes(const std::vector<std::string> &deltas)
+{
+    if (!_quiet)
+    {
+        fprintf(stderr, ">>> sendExportedNodes(): %lu nodes\n", deltas.size());
+    }
+    if (_bEnabled)
+    {
+        pthread_mutex_lock(&_writeMutex);
+        if (!_closed)
+        {
+            std::vector<byte> &buf = _buffers[MSG_EXPORTED_NODES];
+            buf.clear();
+            buf.push_back(MSG_EXPORTED_NODES);
+            appendUInt32(buf, deltas.size());
+            for (size_t i = 0; i < deltas.size(); ++i)
+            {
+                appendUInt32(buf, deltas[i].size());
+                buf.insert(buf.end(), deltas[i].begin(), deltas[i].end());
+            }
+            writeMessage(buf);
+        }
+        pthread_mutex_unlock(&_writeMutex);
     }
 }
 
 void ErlPortInterface::setBestValue(double value, bool fromSolver)
 {
+    setBest(value, fromSolver, NULL, 0, 0);
+}
+
+void ErlPortInterface::setBestSolution(double value, const double *x, int n,
+    const BestValueAcceptor *source)
+{
+    setBest(value, true, x, n, source != NULL ? source->_id : 0);
+}
+
+void ErlPortInterface::setBest(double value, bool fromSolver, const double *x,
+    int n, unsigned source)
+{
+    countPortEvent(fromSolver ? STAT_INCUMBENTS_FOUND : STAT_VALUES_RECEIVED);
     pthread_mutex_lock(&_mutex);
-    switch (_state)
+    unsigned long long locked = portClockNs();
+    if (_state == BV_NONE || isBetter(_bestValue, value))
     {
-    case BV_NONE:
         _state = fromSolver ? BV_FROM_SOLVER : BV_FROM_ERL;
         _bestValue = value;
+        _bestSource = source;
         if (fromSolver)
         {
-            sendIncumbent(value);
+            countPortEvent(STAT_INCUMBENTS_BETTER);
+            _erlSolution.clear();
+            publishIncumbent(value, x, n);
+            // Wakes up the other solvers of the process
+            if (source != 0)
+            {
+                __atomic_add_fetch(&_erlSeq, 1, __ATOMIC_RELEASE);
+            }
         }
-        break;
-    default:
-        if (isBetter(_bestValue, value))
+        else
         {
-            _state = fromSolver ? BV_FROM_SOLVER : BV_FROM_ERL;
-            _bestValue = value;
-            if (fromSolver)
+            if (x != NULL)
+            {
+                _erlSolution.assign(x, x + n);
+            }
+            else
             {
-                sendIncumbent(value);
+                _erlSolution.clear();
             }
+            __atomic_add_fetch(&_erlSeq, 1, __ATOMIC_RELEASE);
         }
     }
+    else if (!fromSolver && x != NULL && _erlSolution.empty()
+        && !isBetter(value, _bestValue))
+    {
+        // The solution for a value known already, e.g. given with -b
+        _state = BV_FROM_ERL;
+        _bestSource = 0;
+        _erlSolution.assign(x, x + n);
+        __atomic_add_fetch(&_erlSeq, 1, __ATOMIC_RELEASE);
+    }
+    else if (!fromSolver)
+    {
+        countPortEvent(STAT_VALUES_IGNORED);
+    }
+    recordPortTime(TIMER_MUTEX_HOLD, portClockNs() - locked);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void ErlPortInterface::resetBestValue()
+{
+    pthread_mutex_lock(&_mutex);
+    _state = BV_NONE;
+    _bestSource = 0;
+    _erlSolution.clear();
+    __atomic_add_fetch(&_erlSeq, 1, __ATOMIC_RELEASE);
     pthread_mutex_unlock(&_mutex);
 }
 
 void ErlPortInterface::getBestValue(BestValueAcceptor &acceptor)
 {
+    // Called for every node, so only lock when Erlang sent something new
+    countPortEvent(STAT_GET_BEST_VALUE);
+    if (__atomic_load_n(&_erlSeq, __ATOMIC_ACQUIRE) == acceptor._seenSeq)
+    {
+        return;
+    }
+
+    countPortEvent(STAT_GET_BEST_VALUE_LOCKED);
     pthread_mutex_lock(&_mutex);
-    if (_state == BV_FROM_ERL)
+    unsigned long long locked = portClockNs();
+    // The solver may have found a better value in the meantime
+    bool accept = _state == BV_FROM_ERL
+        || (_bestSource != 0 && _bestSource != acceptor._id);
+    double value = _bestValue;
+    std::vector<double> solution;
+    if (accept)
     {
+        solution = _erlSolution;
+    }
+    acceptor._seenSeq = _erlSeq;
+    recordPortTime(TIMER_MUTEX_HOLD, portClockNs() - locked);
+    pthread_mutex_unlock(&_mutex);
+
+    // Outside the mutex, the solver reports the solution back if it takes it
+    if (accept)
+    {
+        countPortEvent(STAT_VALUES_ACCEPTED);
         if (!_quiet)
         {
-            fprintf(stderr, ">>> getBestValue(): setting best solution in solver: %lf\n", _bestValue);
+            fprintf(stderr, ">>> getBestValue(): setting best solution in solver: %lf%s\n",
+                value, solution.empty() ? "" : " with values");
+        }
+        if (solution.empty())
+        {
+            acceptor.acceptNewBestValue(value);
+        }
+        else
+        {
+            acceptor.acceptNewBestSolution(value, solution);
         }
-        acceptor.acceptNewBestValue(_bestValue);
-        _state = BV_FROM_SOLVER;
     }
-    pthread_mutex_unlock(&_mutex);
 }
 
 
@@ -226,12 +807,25 @@ void ErlPortInterface::initialize(bool enabled, double bestVal)
 void ErlPortInterface::initialize(bool enabled)
 {
     _bEnabled = enabled;
+    atexit(printPortStats);
 
     if (_bEnabled)
     {
+        _channel.start();
+
+        // Lets the other side check the version before anything else
+        if (_protocol >= 2)
+        {
+            std::vector<byte> &hello = _buffers[MSG_HELLO];
+            hello.push_back(MSG_HELLO);
+            hello.push_back(_protocol);
+            writeMessage(hello);
+        }
+
         pthread_t thread;
         int ret;
-        if ((ret = pthread_create(&thread, NULL, readerLoop, this)))
+        if ((ret = pthread_create(&thread, NULL, readerLoop, this))
+            || (ret = pthread_create(&thread, NULL, publisherLoop, this)))
         {
             fprintf(stderr, ">>> pthread_create() failed with %d\n", ret);
             exit(1);
@@ -239,6 +833,24 @@ void ErlPortInterface::initialize(bool enabled)
     }
 }
 
+static unsigned s_lastAcceptorId = 0;
+
+BestValueAcceptor::BestValueAcceptor()
+    : _seenSeq(0), _id(__atomic_add_fetch(&s_lastAcceptorId, 1, __ATOMIC_RELAXED))
+{
+}
+
+void BestValueAcceptor::acceptNewBestSolution(double bestVal,
+    const std::vector<double> &)
+{
+    acceptNewBestValue(bestVal);
+}
+
+void BestValueAcceptor::resetSeen()
+{
+    _seenSeq = 0;
+}
+
 BestValueAcceptor::~BestValueAcceptor()
 {
 }
@@ -7,14 +7,39 @@
 #define __ERLPORTINTERFACE_H__
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
 #include <pthread.h>
 
+#include "PortChannel.h"
+
 bool isBetter(double oldVal, double newVal);
 
 class BestValueAcceptor {
  public:
+    BestValueAcceptor();
     virtual void acceptNewBestValue(double bestVal) = 0;
+
+    /**
+     * Called instead of acceptNewBestValue() when the value came with a
+     * solution of the problem's variables. It may be infeasible for the
+     * subproblem, so the value must still become the limit. By default
+     * only the value is used.
+     */
+    virtual void acceptNewBestSolution(double bestVal,
+        const std::vector<double> &x);
     virtual ~BestValueAcceptor() = 0;
+
+    /// Makes the acceptor take the current value again, e.g. for a new job
+    void resetSeen();
+
+ private:
+    friend class ErlPortInterface;
+    /// Sequence number of the last value from Erlang seen by this acceptor
+    unsigned _seenSeq;
+    /// Identifies the solver that found a value, unique within the process
+    unsigned _id;
 };
 
 class ErlPortInterface
@@ -28,13 +53,96 @@ class ErlPortInterface
 
     void setBestValue(double value, bool fromSolver);
 
+    /**
+     * Same as setBestValue(value, true), the solution is sent along with
+     * the value by protocol 2. x has the solver's n variables, only the
+     * first setNumVars() of them are the problem's. If the solver's
+     * acceptor is given, the value is passed to the other solvers of the
+     * process as if it came from Erlang.
+     */
+    void setBestSolution(double value, const double *x, int n,
+        const BestValueAcceptor *source = NULL);
+
     void getBestValue(BestValueAcceptor &acceptor);
 
+    /**
+     * Forgets the best value and its solution, e.g. before a job on another
+     * stub. Values from Erlang and the solvers count again from there.
+     */
+    void resetBestValue();
+
     void writeResult(const std::string &status, double bestValue);
 
     void setQuiet(bool quiet);
 
+    /**
+     * Sends at most one incumbent per interval, the best one found by then.
+     * Must be called before initialize().
+     */
+    void setPublishInterval(double seconds);
+
+    /**
+     * Protocol 1 frames messages with 2-byte lengths and sends values only.
+     * Protocol 2 frames with 4-byte lengths, starts with a hello message
+     * and exchanges incumbents with their solution. Must be called before
+     * initialize().
+     */
+    void setProtocol(int version);
+
+    /// Number of variables in the problem, solutions are sent if known
+    void setNumVars(int numVars);
+
+    /**
+     * Returns how many open nodes Erlang asked to give up since the last
+     * call, 0 if none. Cheap enough to call for every node.
+     */
+    int takeExportRequest();
+
+    /// Answers an export request with the nodes given up as delta files
+    void sendExportedNodes(const std::vector<std::string> &deltas);
+
+    /**
+     * True once Erlang asked to stop the solve or closed the port, the
+     * solver should stop as after a limit and send its result. In server mode a cancel applies to
+     * the jobs received before it. Cheap enough to call for every node.
+     */
+    bool isCancelled() const;
+
+    /**
+     * In server mode the port gets jobs until Erlang closes it. Must be
+     * called before initialize().
+     */
+    void setServer(bool server);
+
+    /// Blocks until the next job, returns false once the port is closed
+    bool waitJob(unsigned &id, std::string &job);
+
+    /// Sends the result of a job, the port stays open for more
+    void writeJobResult(unsigned id, const std::string &status,
+        double bestValue);
+
+    /**
+     * Records the state of a solver's search. At most once per progress
+     * interval the weakest dual bound and the total node counts of all
+     * solvers of the process are sent by protocol 2, the last ones also
+     * before a result.
+     */
+    void reportProgress(const BestValueAcceptor &source, double dualBound,
+        long long nodes, long long openNodes);
+
+    /// 0 disables progress messages. Must be called before initialize().
+    void setProgressInterval(double seconds);
+
+    /**
+     * Sends the port statistics printed at exit by protocol 2 as well,
+     * right before the result.
+     */
+    void setSendStats(bool sendStats);
+
  private:
+    /// One past the last message type of the protocol
+    enum { NUM_MESSAGE_TYPES = 14 };
+
     enum BestValueState
     {
         BV_NONE,
@@ -44,12 +152,82 @@ class ErlPortInterface
 
     BestValueState _state;
     double _bestValue;
+    /// Bumped on every value for the solvers to take, read without the mutex
+    unsigned _erlSeq;
+    /// Number of open nodes asked for, exchanged without the mutex
+    int _exportRequest;
+    /// 1 + number of jobs received when the last cancel came, 0 if none
+    unsigned _cancelMark;
+    /// Jobs received by the reader and the number of the job taken
+    unsigned _numJobsReceived;
+    unsigned _currentJob;
     bool _bEnabled;
     pthread_mutex_t _mutex;
     bool _quiet;
+    int _protocol;
+    int _numVars;
+
+    /// Incumbent from the solver waiting for the publisher thread
+    bool _hasPending;
+    double _pendingValue;
+    std::vector<double> _pendingSolution;
+    /// Solution of the best value from Erlang, empty if it came without one
+    std::vector<double> _erlSolution;
+    /// Acceptor id of the solver in this process that found the best value
+    unsigned _bestSource;
+    pthread_cond_t _hasIncumbent;
+    /// The publisher took the pending incumbent and is still sending it
+    bool _sending;
+    pthread_cond_t _incumbentSent;
+    double _publishInterval;
+
+    struct Progress
+    {
+        double dualBound;
+        long long nodes;
+        long long openNodes;
+    };
+
+    /**
+     * Last progress of each solver by acceptor id. Entries are added with
+     * _mutex held, their fields written and read atomically.
+     */
+    std::map<unsigned, Progress> _progress;
+    double _progressInterval;
+    /// Time the next message is due, read without the mutex
+    double _nextProgress;
+    /// Progress recorded since the last one sent, exchanged without the mutex
+    bool _progressChanged;
+    bool _sendStats;
+
+    bool _server;
+    std::deque<std::pair<unsigned, std::string> > _jobs;
+    bool _inputClosed;
+    pthread_cond_t _hasJob;
+
+    /// Serializes messages written by the publisher and the solver thread
+    pthread_mutex_t _writeMutex;
+    bool _closed;
+    /**
+     * Message bodies by type, guarded by _writeMutex. Sending swaps in a
+     * recycled buffer, so they keep their capacity between messages.
+     */
+    std::vector<unsigned char> _buffers[NUM_MESSAGE_TYPES];
+    PortChannel _channel;
 
     static void *readerLoop(void *);
-    void sendIncumbent(double value);
+    static void *publisherLoop(void *);
+    void setBest(double value, bool fromSolver, const double *x, int n,
+        unsigned source);
+    void receiveSolution(const std::vector<unsigned char> &buf, int len);
+    void publishIncumbent(double value, const double *x, int n);
+    void flushIncumbent();
+    Progress takeProgress();
+    void flushProgress();
+    void sendProgress(const Progress &total);
+    void sendIncumbent(double value, const std::vector<double> &solution);
+    int readMessage(std::vector<unsigned char> &buf);
+    void writeMessage(std::vector<unsigned char> &buf);
 
 };
 
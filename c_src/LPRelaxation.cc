@@ -0,0 +1,236 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "LPRelaxation.h"
+#include "common.h"
+
+#include "OsiClpSolverInterface.hpp"
+#include "CoinPackedMatrix.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <float.h>
+
+// Candidates closest to their split point get strong branching
+const size_t MAX_CANDIDATES = 100;
+
+static double clampInf(double v, double inf)
+{
+    return std::max(-inf, std::min(inf, v));
+}
+
+LPRelaxation::LPRelaxation(const mp::ASLProblem &p)
+    : _solver(new OsiClpSolverInterface), _objValue(0)
+{
+    _solver->messageHandler()->setLogLevel(0);
+    double inf = _solver->getInfinity();
+
+    int n = p.num_vars();
+    std::vector<double> obj(n, 0.);
+    _sense = 1.;
+    if (p.num_objs() > 0)
+    {
+        mp::LinearObjExpr e = p.linear_obj_expr(0);
+        for (mp::LinearObjExpr::iterator i = e.begin(); i != e.end(); ++i)
+        {
+            obj[i->var_index()] = i->coef();
+        }
+        if (p.obj_type(0) == mp::obj::MAX)
+        {
+            _sense = -1.;
+        }
+    }
+
+    CoinPackedMatrix matrix(false, 0., 0.);
+    matrix.setDimensions(0, n);
+    std::vector<double> rowLb(p.num_cons());
+    std::vector<double> rowUb(p.num_cons());
+    std::vector<int> indices;
+    std::vector<double> coefs;
+    for (int c = 0; c < p.num_cons(); ++c)
+    {
+        indices.clear();
+        coefs.clear();
+        mp::LinearConExpr e = p.linear_con_expr(c);
+        for (mp::LinearConExpr::iterator i = e.begin(); i != e.end(); ++i)
+        {
+            indices.push_back(i->var_index());
+            coefs.push_back(i->coef());
+        }
+        matrix.appendRow(indices.size(), indices.empty() ? NULL : &(indices[0]),
+            coefs.empty() ? NULL : &(coefs[0]));
+        rowLb[c] = clampInf(p.con_lb()[c], inf);
+        rowUb[c] = clampInf(p.con_ub()[c], inf);
+    }
+
+    _lb.resize(n);
+    _ub.resize(n);
+    for (int v = 0; v < n; ++v)
+    {
+        _lb[v] = clampInf(p.var_lb()[v], inf);
+        _ub[v] = clampInf(p.var_ub()[v], inf);
+    }
+
+    _solver->loadProblem(matrix, &(_lb[0]), &(_ub[0]), &(obj[0]),
+        rowLb.empty() ? NULL : &(rowLb[0]), rowUb.empty() ? NULL : &(rowUb[0]));
+    _solver->setObjSense(_sense);
+}
+
+LPRelaxation::~LPRelaxation()
+{
+    delete _solver;
+}
+
+bool LPRelaxation::solve(const Bounds &bounds)
+{
+    for (size_t v = 0; v < _lb.size(); ++v)
+    {
+        _solver->setColLower(v, _lb[v]);
+        _solver->setColUpper(v, _ub[v]);
+    }
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        _solver->setColLower(bounds[i].var, std::max(_lb[bounds[i].var], bounds[i].lb));
+        _solver->setColUpper(bounds[i].var, std::min(_ub[bounds[i].var], bounds[i].ub));
+    }
+
+    _solver->initialSolve();
+    if (!_solver->isProvenOptimal())
+    {
+        _solution.clear();
+        return false;
+    }
+    _objValue = _solver->getObjValue();
+    const double *x = _solver->getColSolution();
+    _solution.assign(x, x + _lb.size());
+    return true;
+}
+
+bool LPRelaxation::isProvenInfeasible() const
+{
+    return _solver->isProvenPrimalInfeasible();
+}
+
+double LPRelaxation::objValue() const
+{
+    return _objValue;
+}
+
+double LPRelaxation::value(int var) const
+{
+    return _solution[var];
+}
+
+double LPRelaxation::solveChild(int var, double lb, double ub)
+{
+    double oldLb = _solver->getColLower()[var];
+    double oldUb = _solver->getColUpper()[var];
+    _solver->setColLower(var, lb);
+    _solver->setColUpper(var, ub);
+    _solver->solveFromHotStart();
+
+    double result = DBL_MAX;
+    if (!_solver->isProvenPrimalInfeasible())
+    {
+        result = std::max(0., _sense * (_solver->getObjValue() - _objValue));
+    }
+
+    _solver->setColLower(var, oldLb);
+    _solver->setColUpper(var, oldUb);
+    return result;
+}
+
+void LPRelaxation::strongBranch(int var, double left, double right,
+    double &down, double &up)
+{
+    double lb = _solver->getColLower()[var];
+    double ub = _solver->getColUpper()[var];
+
+    _solver->markHotStart();
+    down = value(var) <= left ? 0. : solveChild(var, lb, left);
+    up = value(var) >= right ? 0. : solveChild(var, right, ub);
+    _solver->unmarkHotStart();
+}
+
+static bool betterCandidate(const SplitCandidate &a, const SplitCandidate &b)
+{
+    return a.score > b.score;
+}
+
+static bool closerToSplit(const std::pair<double, int> &a,
+    const std::pair<double, int> &b)
+{
+    return a.first < b.first;
+}
+
+std::vector<SplitCandidate> selectSplitVariables(const mp::ASLProblem &p,
+    int numLeaves)
+{
+    int depth = 0;
+    while ((1 << depth) < numLeaves)
+    {
+        ++depth;
+    }
+
+    LPRelaxation lp(p);
+    if (!lp.solve())
+    {
+        std::cout << "LP relaxation is infeasible" << std::endl;
+        return std::vector<SplitCandidate>();
+    }
+    std::cout << "LP relaxation: " << lp.objValue() << std::endl;
+
+    // Same split points as splitVariableHalfs()
+    std::vector<std::pair<double, int> > vars;
+    for (int v = 0; v < p.num_vars(); ++v)
+    {
+        double lb = p.var_lb()[v];
+        double ub = p.var_ub()[v];
+        if (!isInteger(p, v) || ub <= lb || lb <= -DBL_MAX || ub >= DBL_MAX)
+        {
+            continue;
+        }
+        double left = std::floor(lb + (ub - lb) / 2.);
+        vars.push_back(std::make_pair(std::fabs(lp.value(v) - left - .5), v));
+    }
+    std::sort(vars.begin(), vars.end(), closerToSplit);
+    if (vars.size() > MAX_CANDIDATES)
+    {
+        vars.resize(MAX_CANDIDATES);
+    }
+
+    const double eps = 1e-6;
+    std::vector<SplitCandidate> candidates;
+    for (size_t i = 0; i < vars.size(); ++i)
+    {
+        int v = vars[i].second;
+        double left = std::floor(p.var_lb()[v] + (p.var_ub()[v] - p.var_lb()[v]) / 2.);
+        SplitCandidate c;
+        c.var = v;
+        lp.strongBranch(v, left, left + 1., c.down, c.up);
+        // An infeasible half would be a wasted subproblem
+        if (c.down >= DBL_MAX || c.up >= DBL_MAX)
+        {
+            continue;
+        }
+        double lo = std::max(std::min(c.down, c.up), eps);
+        double hi = std::max(std::max(c.down, c.up), eps);
+        c.score = lo * hi * (1. + lo / hi) / 2.;
+        candidates.push_back(c);
+    }
+    std::sort(candidates.begin(), candidates.end(), betterCandidate);
+
+    if (candidates.size() < (size_t)depth)
+    {
+        std::cout << "Only " << candidates.size()
+                  << " variables can be split" << std::endl;
+    }
+    else
+    {
+        candidates.resize(depth);
+    }
+    return candidates;
+}
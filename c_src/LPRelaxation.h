@@ -0,0 +1,78 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#ifndef __LPRELAXATION_H__
+#define __LPRELAXATION_H__
+
+#include "asl/aslproblem.h"
+#include "delta.h"
+
+class OsiClpSolverInterface;
+
+/**
+ * LP relaxation of the linear part of a problem, solved with Clp.
+ *
+ * Objective values are in the sense of the problem, degradations are
+ * always nonnegative.
+ */
+class LPRelaxation
+{
+ public:
+    explicit LPRelaxation(const mp::ASLProblem &p);
+
+    ~LPRelaxation();
+
+    /// Solves with the bounds of the subproblem, returns false if not solved
+    bool solve(const Bounds &bounds = Bounds());
+
+    /// Whether the last solve() failed since the problem is infeasible
+    bool isProvenInfeasible() const;
+
+    double objValue() const;
+
+    double value(int var) const;
+
+    /**
+     * Estimates how much the objective of the last solve() worsens on both
+     * sides of splitting var into [lb, left] and [right, ub]. An infeasible
+     * side gets infinity.
+     */
+    void strongBranch(int var, double left, double right,
+        double &down, double &up);
+
+ private:
+    OsiClpSolverInterface *_solver;
+    std::vector<double> _lb;
+    std::vector<double> _ub;
+    double _sense;
+    double _objValue;
+    std::vector<double> _solution;
+
+    double solveChild(int var, double lb, double ub);
+
+    LPRelaxation(const LPRelaxation &);
+    LPRelaxation &operator=(const LPRelaxation &);
+};
+
+struct SplitCandidate
+{
+    int var;
+    double down;
+    double up;
+    double score;
+};
+
+/**
+ * Picks variables for halfs splits giving about numLeaves subproblems.
+ *
+ * Integer variables are scored by strong branching on the LP relaxation.
+ * The score is the product of the degradations, scaled by how close they
+ * are to each other, so that both halves are likely to have comparable
+ * subtrees.
+ */
+std::vector<SplitCandidate> selectSplitVariables(const mp::ASLProblem &p,
+    int numLeaves);
+
+#endif // __LPRELAXATION_H__
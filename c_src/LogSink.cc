@@ -0,0 +1,148 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "LogSink.h"
+
+#include <algorithm>
+#include <sys/time.h>
+#include <string.h>
+#include <stdio.h>
+
+// Seconds between flushes of the gzip stream
+const double FLUSH_INTERVAL = 1;
+
+static double getTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+LogSink::LogSink(size_t tailBytes)
+    : _file(NULL), _tail(tailBytes), _tailPos(0), _tailFull(false),
+      _lastFlush(0)
+{
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+LogSink::~LogSink()
+{
+    close();
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool LogSink::open(const std::string &fileName)
+{
+    // Level 1: most of the size reduction for a small cost per byte
+    _file = gzopen(fileName.c_str(), "wb1");
+    if (_file == NULL)
+    {
+        fprintf(stderr, ">>> Failed to open %s for writing\n", fileName.c_str());
+        return false;
+    }
+    _fileName = fileName;
+    _lastFlush = getTime();
+    return true;
+}
+
+void LogSink::write(const char *data, size_t len)
+{
+    pthread_mutex_lock(&_mutex);
+    if (_file == NULL)
+    {
+        pthread_mutex_unlock(&_mutex);
+        return;
+    }
+    gzwrite(_file, data, len);
+
+    // Only the last _tail.size() bytes can stay
+    size_t size = _tail.size();
+    if (size == 0)
+    {
+        len = 0;
+    }
+    else if (len > size)
+    {
+        data += len - size;
+        len = size;
+    }
+    while (len > 0)
+    {
+        size_t n = std::min(len, size - _tailPos);
+        memcpy(&(_tail[_tailPos]), data, n);
+        data += n;
+        len -= n;
+        _tailPos += n;
+        if (_tailPos == size)
+        {
+            _tailPos = 0;
+            _tailFull = true;
+        }
+    }
+
+    double now = getTime();
+    if (now - _lastFlush >= FLUSH_INTERVAL)
+    {
+        gzflush(_file, Z_SYNC_FLUSH);
+        _lastFlush = now;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void LogSink::close()
+{
+    pthread_mutex_lock(&_mutex);
+    if (_file != NULL)
+    {
+        gzclose(_file);
+        _file = NULL;
+        writeTail();
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// Called with _mutex held
+void LogSink::writeTail()
+{
+    std::string tailName = _fileName + ".tail";
+    if (_tail.empty())
+    {
+        return;
+    }
+    FILE *f = fopen(tailName.c_str(), "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, ">>> Failed to open %s for writing\n", tailName.c_str());
+        return;
+    }
+    if (!_tailFull)
+    {
+        fwrite(&(_tail[0]), 1, _tailPos, f);
+        fclose(f);
+        return;
+    }
+
+    // The oldest bytes from _tailPos on, then the newest before it. A line
+    // cut at the start is dropped, it may end in either segment.
+    const char *first = &(_tail[0]) + _tailPos;
+    size_t firstLen = _tail.size() - _tailPos;
+    const char *second = &(_tail[0]);
+    size_t secondLen = _tailPos;
+    const char *nl = (const char *)memchr(first, '\n', firstLen);
+    if (nl != NULL)
+    {
+        firstLen -= nl + 1 - first;
+        first = nl + 1;
+    }
+    else if ((nl = (const char *)memchr(second, '\n', secondLen)) != NULL)
+    {
+        firstLen = 0;
+        secondLen -= nl + 1 - second;
+        second = nl + 1;
+    }
+    fwrite(first, 1, firstLen, f);
+    fwrite(second, 1, secondLen, f);
+    fclose(f);
+}
@@ -0,0 +1,54 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#ifndef __LOGSINK_H__
+#define __LOGSINK_H__
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <zlib.h>
+
+/**
+ * Solver output streamed to a gzip file as it comes, so a log of any size
+ * takes a few buffers of memory and a fraction of the disk writes. The
+ * last bytes are also kept in a ring buffer and written uncompressed to
+ * <file>.tail on close(), to look at the end of a run without unpacking.
+ *
+ * write() may be called from any thread.
+ */
+class LogSink
+{
+ public:
+    explicit LogSink(size_t tailBytes = 64 << 10);
+
+    ~LogSink();
+
+    /// Returns false if the file can't be opened, writes are dropped then
+    bool open(const std::string &fileName);
+
+    void write(const char *data, size_t len);
+
+    /// Finishes the gzip stream and writes the tail
+    void close();
+
+ private:
+    std::string _fileName;
+    gzFile _file;
+    /// Ring buffer of the last bytes written, _tailPos is the oldest
+    std::vector<char> _tail;
+    size_t _tailPos;
+    bool _tailFull;
+    /// Time of the last gzflush(), so zcat sees a running log
+    double _lastFlush;
+    pthread_mutex_t _mutex;
+
+    void writeTail();
+
+    LogSink(const LogSink &);
+    LogSink &operator=(const LogSink &);
+};
+
+#endif // __LOGSINK_H__
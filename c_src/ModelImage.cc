@@ -0,0 +1,257 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "ModelImage.h"
+
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+ModelImage::ModelImage()
+    : _data(NULL), _size(0), _header(NULL)
+{
+}
+
+ModelImage::~ModelImage()
+{
+    if (_data != NULL)
+    {
+        munmap((void *)_data, _size);
+    }
+}
+
+// Whether count elements of elemSize at offset are within the image
+static bool fits(uint64_t offset, uint64_t count, uint64_t elemSize,
+    uint64_t size)
+{
+    return offset % 8 == 0 && offset <= size
+        && (elemSize == 0 || count <= (size - offset) / elemSize);
+}
+
+static bool namesFit(const char *data, uint64_t table, int count,
+    uint64_t size)
+{
+    if (!fits(table, count + 1, sizeof(int64_t), size))
+    {
+        return false;
+    }
+    // Names follow one another after the table, each ends with a 0
+    const int64_t *offsets = (const int64_t *)(data + table);
+    uint64_t end = table + (count + 1) * sizeof(int64_t);
+    for (int i = 0; i < count; ++i)
+    {
+        if ((uint64_t)offsets[i] < end || offsets[i + 1] <= offsets[i]
+            || (uint64_t)offsets[i + 1] > size || data[offsets[i + 1] - 1] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ModelImage::map(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, ">>> Failed to open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ModelImageHeader))
+    {
+        fprintf(stderr, ">>> %s is not a model image\n", path.c_str());
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, ">>> mmap() of %s failed: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    _data = (const char *)data;
+    _size = st.st_size;
+    _header = (const ModelImageHeader *)_data;
+
+    const ModelImageHeader &h = *_header;
+    uint64_t n = h.numVars, m = h.numCons;
+    bool valid = !memcmp(h.magic, MODEL_IMAGE_MAGIC, 8) && h.size == _size
+        && h.numVars >= 0 && h.numCons >= 0 && h.numNonzeros >= 0
+        && h.numOptions >= 0 && h.numOptions <= MODEL_IMAGE_MAX_OPTIONS
+        && fits(h.obj, n, sizeof(double), _size)
+        && fits(h.varLb, n, sizeof(double), _size)
+        && fits(h.varUb, n, sizeof(double), _size)
+        && fits(h.varInteger, n, 1, _size)
+        && fits(h.conLb, m, sizeof(double), _size)
+        && fits(h.conUb, m, sizeof(double), _size)
+        && fits(h.rowStart, m + 1, sizeof(int64_t), _size)
+        && fits(h.colIndex, h.numNonzeros, sizeof(int32_t), _size)
+        && fits(h.values, h.numNonzeros, sizeof(double), _size)
+        && namesFit(_data, h.varNames, h.numVars, _size)
+        && namesFit(_data, h.conNames, h.numCons, _size);
+    // Everything the solvers index with is checked once here
+    for (uint64_t i = 0; valid && i < m; ++i)
+    {
+        valid = rowStart()[i] <= rowStart()[i + 1];
+    }
+    if (valid)
+    {
+        valid = rowStart()[0] == 0 && rowStart()[m] == h.numNonzeros;
+    }
+    for (int64_t k = 0; valid && k < h.numNonzeros; ++k)
+    {
+        valid = colIndex()[k] >= 0 && colIndex()[k] < h.numVars;
+    }
+    if (!valid)
+    {
+        fprintf(stderr, ">>> %s is not a valid model image\n", path.c_str());
+        munmap(data, _size);
+        _data = NULL;
+        _header = NULL;
+        return false;
+    }
+    return true;
+}
+
+// The layout of ASL's write_sol() for a text solution
+bool ModelImage::writeSolution(const std::string &path,
+    const std::string &message, const double *x, int solveResult) const
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, ">>> Failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+    fprintf(f, "%s\n\n", message.c_str());
+    const ModelImageHeader &h = *_header;
+    if (h.numOptions > 0)
+    {
+        bool vbtol = h.numOptions >= 2 && h.options[1] == 3;
+        fprintf(f, "Options\n%d\n", h.numOptions + (vbtol ? 1 : 0));
+        for (int i = 0; i < h.numOptions; ++i)
+        {
+            fprintf(f, "%d\n", h.options[i]);
+        }
+        if (vbtol)
+        {
+            fprintf(f, "%.17g\n", h.vbtol);
+        }
+    }
+    int numValues = x != NULL ? h.numVars : 0;
+    fprintf(f, "%d\n0\n%d\n%d\n", h.numCons, h.numVars, numValues);
+    for (int i = 0; i < numValues; ++i)
+    {
+        fprintf(f, "%.17g\n", x[i]);
+    }
+    fprintf(f, "objno 0 %d\n", solveResult);
+    return fclose(f) == 0;
+}
+
+// Appends bytes at an 8-byte boundary, returns their offset
+static uint64_t append(std::vector<char> &buf, const void *p, size_t bytes)
+{
+    buf.resize((buf.size() + 7) / 8 * 8);
+    uint64_t offset = buf.size();
+    if (bytes > 0)
+    {
+        buf.insert(buf.end(), (const char *)p, (const char *)p + bytes);
+    }
+    return offset;
+}
+
+template <class T>
+static uint64_t appendVector(std::vector<char> &buf, const std::vector<T> &v)
+{
+    return append(buf, v.empty() ? NULL : &(v[0]), v.size() * sizeof(T));
+}
+
+static uint64_t appendNames(std::vector<char> &buf,
+    const std::vector<std::string> &names)
+{
+    std::vector<int64_t> offsets(names.size() + 1);
+    uint64_t table = appendVector(buf, offsets);
+    uint64_t pos = buf.size();
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        offsets[i] = pos;
+        pos += names[i].size() + 1;
+    }
+    offsets[names.size()] = pos;
+    memcpy(&(buf[table]), &(offsets[0]), offsets.size() * sizeof(int64_t));
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        buf.insert(buf.end(), names[i].c_str(), names[i].c_str() + names[i].size() + 1);
+    }
+    return table;
+}
+
+bool writeModelImage(const std::string &path, const ModelImageData &data)
+{
+    ModelImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MODEL_IMAGE_MAGIC, 8);
+    h.numVars = data.obj.size();
+    h.numCons = data.conLb.size();
+    h.numNonzeros = data.values.size();
+    h.sense = data.sense;
+    h.numOptions = std::min((int)data.options.size(), MODEL_IMAGE_MAX_OPTIONS);
+    for (int i = 0; i < h.numOptions; ++i)
+    {
+        h.options[i] = data.options[i];
+    }
+    h.vbtol = data.vbtol;
+    h.objConstant = data.objConstant;
+
+    std::vector<char> buf(sizeof(h));
+    h.obj = appendVector(buf, data.obj);
+    h.varLb = appendVector(buf, data.varLb);
+    h.varUb = appendVector(buf, data.varUb);
+    h.varInteger = appendVector(buf, data.varInteger);
+    h.conLb = appendVector(buf, data.conLb);
+    h.conUb = appendVector(buf, data.conUb);
+    h.rowStart = appendVector(buf, data.rowStart);
+    h.colIndex = appendVector(buf, data.colIndex);
+    h.values = appendVector(buf, data.values);
+    h.varNames = appendNames(buf, data.varNames);
+    h.conNames = appendNames(buf, data.conNames);
+    h.size = buf.size();
+    memcpy(&(buf[0]), &h, sizeof(h));
+
+    std::string tmp(path + ".tmp");
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(&(buf[0]), 1, buf.size(), f) == buf.size();
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()))
+    {
+        fprintf(stderr, "Failed to write %s\n", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string imageNameNL(const std::string &nlPath)
+{
+    size_t dot = nlPath.find_last_of('.');
+    size_t delim = nlPath.find_last_of("/\\");
+    if (dot == std::string::npos || (delim != std::string::npos && dot < delim))
+    {
+        return nlPath + ".img";
+    }
+    return nlPath.substr(0, dot) + ".img";
+}
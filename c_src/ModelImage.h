@@ -0,0 +1,205 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Linear problem parsed once and stored in a binary file that the ports
+ * of a node map read-only, so its pages are shared and no port parses the
+ * NL file again.
+ *
+ * The file is a header followed by the arrays, each at an 8-byte aligned
+ * offset from the start of the file, so it is read in place wherever it is
+ * mapped. The constraint matrix is stored by rows. Names are a table of
+ * count + 1 offsets into the characters that follow, each name ending with
+ * a 0. Bounds are the NL file's, infinite ones as HUGE_VAL.
+ */
+
+#ifndef __MODELIMAGE_H__
+#define __MODELIMAGE_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#define MODEL_IMAGE_MAGIC "DCBCIMG1"
+
+const int MODEL_IMAGE_MAX_OPTIONS = 9;
+
+struct ModelImageHeader
+{
+    char magic[8];
+    int32_t numVars;
+    int32_t numCons;
+    int64_t numNonzeros;
+    /// 1 to minimize, -1 to maximize
+    int32_t sense;
+    /// AMPL options of the NL header, written back to the .sol file
+    int32_t numOptions;
+    int32_t options[MODEL_IMAGE_MAX_OPTIONS];
+    int32_t reserved;
+    double vbtol;
+    double objConstant;
+
+    // Offsets from the start of the file
+    uint64_t obj;
+    uint64_t varLb;
+    uint64_t varUb;
+    /// One byte per variable, 1 if integer
+    uint64_t varInteger;
+    uint64_t conLb;
+    uint64_t conUb;
+    /// numCons + 1 int64_t offsets into colIndex and values
+    uint64_t rowStart;
+    uint64_t colIndex;
+    uint64_t values;
+    uint64_t varNames;
+    uint64_t conNames;
+    uint64_t size;
+};
+
+/// A mapped image, valid until the object is destroyed
+class ModelImage
+{
+ public:
+    ModelImage();
+
+    ~ModelImage();
+
+    /// Returns false with a message if the file isn't a valid image
+    bool map(const std::string &path);
+
+    int numVars() const
+    {
+        return _header->numVars;
+    }
+
+    int numCons() const
+    {
+        return _header->numCons;
+    }
+
+    bool minimize() const
+    {
+        return _header->sense > 0;
+    }
+
+    double objConstant() const
+    {
+        return _header->objConstant;
+    }
+
+    const double *obj() const
+    {
+        return (const double *)at(_header->obj);
+    }
+
+    const double *varLb() const
+    {
+        return (const double *)at(_header->varLb);
+    }
+
+    const double *varUb() const
+    {
+        return (const double *)at(_header->varUb);
+    }
+
+    bool isInteger(int var) const
+    {
+        return at(_header->varInteger)[var] != 0;
+    }
+
+    const double *conLb() const
+    {
+        return (const double *)at(_header->conLb);
+    }
+
+    const double *conUb() const
+    {
+        return (const double *)at(_header->conUb);
+    }
+
+    const int64_t *rowStart() const
+    {
+        return (const int64_t *)at(_header->rowStart);
+    }
+
+    const int32_t *colIndex() const
+    {
+        return (const int32_t *)at(_header->colIndex);
+    }
+
+    const double *values() const
+    {
+        return (const double *)at(_header->values);
+    }
+
+    const char *varName(int var) const
+    {
+        return name(_header->varNames, var);
+    }
+
+    const char *conName(int con) const
+    {
+        return name(_header->conNames, con);
+    }
+
+    /**
+     * Writes an AMPL solution file like the one of the ASL for the NL file
+     * the image was made of. x has numVars() values or is NULL if there is
+     * no solution. solveResult is AMPL's solve_result_num: 0 solved, 200
+     * infeasible, 400 limit.
+     */
+    bool writeSolution(const std::string &path, const std::string &message,
+        const double *x, int solveResult) const;
+
+ private:
+    const char *_data;
+    size_t _size;
+    const ModelImageHeader *_header;
+
+    const char *at(uint64_t offset) const
+    {
+        return _data + offset;
+    }
+
+    const char *name(uint64_t table, int i) const
+    {
+        const int64_t *offsets = (const int64_t *)at(table);
+        return at(offsets[i]);
+    }
+
+    ModelImage(const ModelImage &);
+    ModelImage &operator=(const ModelImage &);
+};
+
+/// What writeModelImage() lays out, numVars and numCons by the vector sizes
+struct ModelImageData
+{
+    ModelImageData()
+        : sense(1), vbtol(0), objConstant(0)
+    {
+    }
+
+    int sense;
+    std::vector<int> options;
+    double vbtol;
+    double objConstant;
+    std::vector<double> obj;
+    std::vector<double> varLb;
+    std::vector<double> varUb;
+    std::vector<char> varInteger;
+    std::vector<double> conLb;
+    std::vector<double> conUb;
+    std::vector<int64_t> rowStart;
+    std::vector<int32_t> colIndex;
+    std::vector<double> values;
+    std::vector<std::string> varNames;
+    std::vector<std::string> conNames;
+};
+
+/// Writes to a temporary file renamed to path, so a mapped image never changes
+bool writeModelImage(const std::string &path, const ModelImageData &data);
+
+/// Returns the path of the image made of an NL file: x.nl -> x.img
+std::string imageNameNL(const std::string &nlPath);
+
+#endif // __MODELIMAGE_H__
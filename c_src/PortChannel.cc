@@ -0,0 +1,292 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "PortChannel.h"
+
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+
+// Frames written by one writev(), two buffers each
+const size_t MAX_FRAMES_PER_WRITE = 64;
+// Recycled buffers kept, bigger ones are freed
+const size_t MAX_FREE_BUFFERS = 16;
+const size_t MAX_FREE_CAPACITY = 1 << 20;
+
+PortChannel::PortChannel(int inFd, int outFd)
+    : _inFd(inFd), _outFd(outFd), _lengthBytes(2), _queueLimit(16 << 20),
+      _queuedBytes(0), _writing(false), _failed(false), _started(false)
+{
+    _wakeFds[0] = _wakeFds[1] = -1;
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_hasFrames, NULL);
+    pthread_cond_init(&_hasSpace, NULL);
+    pthread_cond_init(&_written, NULL);
+}
+
+// The channel lives as long as the process, the writer thread is left to exit
+PortChannel::~PortChannel()
+{
+    if (_started)
+    {
+        close(_wakeFds[0]);
+        close(_wakeFds[1]);
+    }
+}
+
+void PortChannel::setLengthBytes(int lengthBytes)
+{
+    _lengthBytes = lengthBytes;
+}
+
+void PortChannel::setQueueLimit(size_t bytes)
+{
+    _queueLimit = bytes;
+}
+
+// The pipe is made here rather than by the constructor of a global channel,
+// which could run before fds 3 and 4 are set up and take them
+void PortChannel::start()
+{
+    if (pipe(_wakeFds))
+    {
+        fprintf(stderr, ">>> pipe() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    // Once Erlang closes the port writev() fails instead of killing the
+    // process, the reader cancels the solve
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    int ret;
+    if ((ret = pthread_create(&thread, NULL, writerLoop, this)))
+    {
+        fprintf(stderr, ">>> pthread_create() failed with %d\n", ret);
+        exit(1);
+    }
+    _started = true;
+}
+
+bool PortChannel::readExact(unsigned char *buf, size_t len)
+{
+    struct pollfd fds[2];
+    fds[0].fd = _inFd;
+    fds[0].events = POLLIN;
+    // Ignored by poll() before start()
+    fds[1].fd = _wakeFds[0];
+    fds[1].events = POLLIN;
+
+    size_t got = 0;
+    while (got < len)
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if (fds[1].revents)
+        {
+            return false;
+        }
+        ssize_t ret = ::read(_inFd, buf + got, len - got);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            return false;
+        }
+        got += ret;
+    }
+    return true;
+}
+
+int PortChannel::read(std::vector<unsigned char> &buf)
+{
+    unsigned char header[4];
+    if (!readExact(header, _lengthBytes))
+    {
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < _lengthBytes; ++i)
+    {
+        len = (len << 8) | header[i];
+    }
+    buf.resize(len);
+    if (len > 0 && !readExact(&(buf[0]), len))
+    {
+        return -1;
+    }
+    return len;
+}
+
+void PortChannel::send(std::vector<unsigned char> &body)
+{
+    pthread_mutex_lock(&_mutex);
+    while (_queuedBytes > _queueLimit && !_failed)
+    {
+        pthread_cond_wait(&_hasSpace, &_mutex);
+    }
+    if (_failed)
+    {
+        pthread_mutex_unlock(&_mutex);
+        body.clear();
+        return;
+    }
+
+    _queue.push_back(Frame());
+    Frame &frame = _queue.back();
+    size_t len = body.size();
+    for (int i = 0; i < _lengthBytes; ++i)
+    {
+        frame.header[i] = (len >> (8 * (_lengthBytes - 1 - i))) & 0xFF;
+    }
+    frame.body.swap(body);
+    if (!_free.empty())
+    {
+        body.swap(_free.back());
+        _free.pop_back();
+    }
+    _queuedBytes += len;
+    pthread_cond_signal(&_hasFrames);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void PortChannel::flush()
+{
+    pthread_mutex_lock(&_mutex);
+    while ((!_queue.empty() || _writing) && !_failed && _started)
+    {
+        pthread_cond_wait(&_written, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void PortChannel::shutdown()
+{
+    if (!_started)
+    {
+        return;
+    }
+    char c = 0;
+    if (write(_wakeFds[1], &c, 1) != 1)
+    {
+        fprintf(stderr, ">>> Failed to wake the port reader: %s\n", strerror(errno));
+    }
+}
+
+void *PortChannel::writerLoop(void *ptr)
+{
+    PortChannel *This = (PortChannel *)ptr;
+    std::deque<Frame> frames;
+
+    while (true)
+    {
+        pthread_mutex_lock(&This->_mutex);
+        while (This->_queue.empty())
+        {
+            pthread_cond_wait(&This->_hasFrames, &This->_mutex);
+        }
+        frames.swap(This->_queue);
+        This->_writing = true;
+        This->_queuedBytes = 0;
+        pthread_cond_broadcast(&This->_hasSpace);
+        pthread_mutex_unlock(&This->_mutex);
+
+        bool ok = This->writeFrames(frames);
+
+        pthread_mutex_lock(&This->_mutex);
+        for (size_t i = 0; i < frames.size(); ++i)
+        {
+            std::vector<unsigned char> &body = frames[i].body;
+            if (This->_free.size() < MAX_FREE_BUFFERS
+                && body.capacity() <= MAX_FREE_CAPACITY)
+            {
+                body.clear();
+                This->_free.push_back(std::vector<unsigned char>());
+                This->_free.back().swap(body);
+            }
+        }
+        frames.clear();
+        This->_writing = false;
+        if (!ok)
+        {
+            This->_failed = true;
+            This->_queue.clear();
+            pthread_cond_broadcast(&This->_hasSpace);
+        }
+        pthread_cond_broadcast(&This->_written);
+        pthread_mutex_unlock(&This->_mutex);
+
+        if (!ok)
+        {
+            return NULL;
+        }
+    }
+}
+
+bool PortChannel::writeFrames(std::deque<Frame> &frames)
+{
+    struct iovec iov[2 * MAX_FRAMES_PER_WRITE];
+    size_t next = 0;
+    while (next < frames.size())
+    {
+        int count = 0;
+        for (; next < frames.size() && count + 2 <= (int)(2 * MAX_FRAMES_PER_WRITE);
+             ++next)
+        {
+            iov[count].iov_base = frames[next].header;
+            iov[count].iov_len = _lengthBytes;
+            ++count;
+            if (!frames[next].body.empty())
+            {
+                iov[count].iov_base = &(frames[next].body[0]);
+                iov[count].iov_len = frames[next].body.size();
+                ++count;
+            }
+        }
+
+        // Partial writes continue from where the pipe stopped taking bytes
+        struct iovec *p = iov;
+        while (count > 0)
+        {
+            ssize_t ret = writev(_outFd, p, count);
+            if (ret < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ret < 0)
+            {
+                fprintf(stderr, ">>> writev() failed: %s\n", strerror(errno));
+                return false;
+            }
+            size_t wrote = ret;
+            while (count > 0 && wrote >= p->iov_len)
+            {
+                wrote -= p->iov_len;
+                ++p;
+                --count;
+            }
+            if (count > 0)
+            {
+                p->iov_base = (char *)p->iov_base + wrote;
+                p->iov_len -= wrote;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#ifndef __PORTCHANNEL_H__
+#define __PORTCHANNEL_H__
+
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+/**
+ * Length-prefixed frames over a pair of file descriptors, fds 3 and 4 of
+ * an Erlang port started with nouse_stdio.
+ *
+ * Frames sent are queued and written by a writer thread with one writev()
+ * for all frames queued by then, so solver threads don't wait for the pipe
+ * unless more than the queue limit is pending. Buffers given to send() are
+ * swapped with recycled ones, so a caller reusing its buffer doesn't
+ * allocate once the sizes settle.
+ *
+ * One thread reads. read() can be woken up by shutdown() from any thread.
+ */
+class PortChannel
+{
+ public:
+    PortChannel(int inFd = 3, int outFd = 4);
+
+    ~PortChannel();
+
+    /// 2 or 4 bytes of length before each frame, before start()
+    void setLengthBytes(int lengthBytes);
+
+    /// Bytes queued before send() blocks, before start()
+    void setQueueLimit(size_t bytes);
+
+    /// Starts the writer thread, after fds 3 and 4 are open
+    void start();
+
+    /**
+     * Reads the next frame into buf, resized to its length. Returns the
+     * length, 0 for an empty frame, -1 on end of input, error or shutdown().
+     */
+    int read(std::vector<unsigned char> &buf);
+
+    /**
+     * Queues body as a frame. body gets a recycled buffer back, empty but
+     * possibly with capacity. Frames are written in the order queued.
+     */
+    void send(std::vector<unsigned char> &body);
+
+    /// Waits until all frames queued are written or writing failed
+    void flush();
+
+    /// Makes a blocked or later read() return -1
+    void shutdown();
+
+ private:
+    struct Frame
+    {
+        unsigned char header[4];
+        std::vector<unsigned char> body;
+    };
+
+    int _inFd;
+    int _outFd;
+    int _lengthBytes;
+    size_t _queueLimit;
+    /// read() polls it along with _inFd, written by shutdown()
+    int _wakeFds[2];
+
+    pthread_mutex_t _mutex;
+    pthread_cond_t _hasFrames;
+    pthread_cond_t _hasSpace;
+    pthread_cond_t _written;
+    std::deque<Frame> _queue;
+    size_t _queuedBytes;
+    /// A frame taken by the writer thread isn't written yet
+    bool _writing;
+    bool _failed;
+    bool _started;
+    std::vector<std::vector<unsigned char> > _free;
+
+    static void *writerLoop(void *);
+    bool writeFrames(std::deque<Frame> &frames);
+    bool readExact(unsigned char *buf, size_t len);
+
+    PortChannel(const PortChannel &);
+    PortChannel &operator=(const PortChannel &);
+};
+
+#endif // __PORTCHANNEL_H__
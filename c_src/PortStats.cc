@@ -0,0 +1,186 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "PortStats.h"
+
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+
+// Bucket i counts times below 2^(i+1) ns, the last one the longer ones
+const int NUM_BUCKETS = 40;
+
+static const char *s_counterNames[NUM_PORT_COUNTERS] = {
+    "get_best_value",
+    "get_best_value_locked",
+    "values_accepted",
+    "incumbents_found",
+    "incumbents_better",
+    "incumbents_sent",
+    "values_received",
+    "values_ignored",
+    "progress_sent",
+    "messages_sent",
+    "bytes_sent",
+    "solver_compares",
+    "solver_events"
+};
+
+static const char *s_timerNames[NUM_PORT_TIMERS] = {
+    "mutex_hold",
+    "send",
+    "solver_event"
+};
+
+struct Histogram
+{
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned long long buckets[NUM_BUCKETS];
+};
+
+/// Written by its thread only, read by formatPortStats() at any time
+struct ThreadStats
+{
+    unsigned long long counters[NUM_PORT_COUNTERS];
+    Histogram timers[NUM_PORT_TIMERS];
+    ThreadStats *next;
+};
+
+/// Blocks of all threads that counted, kept after they exit
+static ThreadStats *s_allStats = NULL;
+static __thread ThreadStats *t_stats = NULL;
+
+static ThreadStats *threadStats()
+{
+    if (t_stats == NULL)
+    {
+        ThreadStats *stats = new ThreadStats;
+        memset(stats, 0, sizeof(*stats));
+        stats->next = __atomic_load_n(&s_allStats, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&s_allStats, &stats->next, stats,
+                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+        t_stats = stats;
+    }
+    return t_stats;
+}
+
+// Only this thread writes, so a load and a store make the increment
+static void add(unsigned long long *p, unsigned long long n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+        __ATOMIC_RELAXED);
+}
+
+static unsigned long long load(const unsigned long long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+unsigned long long portClockNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void countPortEvent(PortCounter counter, unsigned long long n)
+{
+    add(&(threadStats()->counters[counter]), n);
+}
+
+void recordPortTime(PortTimer timer, unsigned long long ns)
+{
+    Histogram &h = threadStats()->timers[timer];
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= NUM_BUCKETS)
+    {
+        bucket = NUM_BUCKETS - 1;
+    }
+    add(&h.count, 1);
+    add(&h.total, ns);
+    add(&(h.buckets[bucket]), 1);
+    if (ns > load(&h.max))
+    {
+        __atomic_store_n(&h.max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+// Upper bound of the bucket holding the given fraction of the times
+static unsigned long long percentile(const Histogram &h, double fraction)
+{
+    unsigned long long rank = (unsigned long long)(h.count * fraction);
+    unsigned long long seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i)
+    {
+        seen += h.buckets[i];
+        if (seen > rank)
+        {
+            return 2ULL << i;
+        }
+    }
+    return h.max;
+}
+
+std::string formatPortStats()
+{
+    unsigned long long counters[NUM_PORT_COUNTERS];
+    Histogram timers[NUM_PORT_TIMERS];
+    memset(counters, 0, sizeof(counters));
+    memset(timers, 0, sizeof(timers));
+    int numThreads = 0;
+    for (ThreadStats *stats = __atomic_load_n(&s_allStats, __ATOMIC_ACQUIRE);
+         stats != NULL; stats = stats->next)
+    {
+        ++numThreads;
+        for (int i = 0; i < NUM_PORT_COUNTERS; ++i)
+        {
+            counters[i] += load(&(stats->counters[i]));
+        }
+        for (int i = 0; i < NUM_PORT_TIMERS; ++i)
+        {
+            const Histogram &from = stats->timers[i];
+            Histogram &to = timers[i];
+            to.count += load(&from.count);
+            to.total += load(&from.total);
+            if (load(&from.max) > to.max)
+            {
+                to.max = load(&from.max);
+            }
+            for (int j = 0; j < NUM_BUCKETS; ++j)
+            {
+                to.buckets[j] += load(&(from.buckets[j]));
+            }
+        }
+    }
+
+    std::string result;
+    char buf[256];
+    sprintf(buf, "{\"threads\":%d", numThreads);
+    result += buf;
+    for (int i = 0; i < NUM_PORT_COUNTERS; ++i)
+    {
+        sprintf(buf, ",\"%s\":%llu", s_counterNames[i], counters[i]);
+        result += buf;
+    }
+    for (int i = 0; i < NUM_PORT_TIMERS; ++i)
+    {
+        const Histogram &h = timers[i];
+        sprintf(buf, ",\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"max_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu}",
+            s_timerNames[i], h.count, h.total, h.max,
+            percentile(h, 0.5), percentile(h, 0.99));
+        result += buf;
+    }
+    result += "}";
+    return result;
+}
+
+void printPortStats()
+{
+    fprintf(stderr, ">>> port stats: %s\n", formatPortStats().c_str());
+}
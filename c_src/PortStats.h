@@ -0,0 +1,88 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Counters and timing histograms of the hot paths between the port and
+ * the solver. Each thread counts into a block of its own with plain
+ * stores, so counting costs no more than an increment; the blocks are
+ * only summed for formatPortStats(). Times are in nanoseconds, bucketed
+ * by powers of two.
+ */
+
+#ifndef __PORTSTATS_H__
+#define __PORTSTATS_H__
+
+#include <string>
+
+enum PortCounter
+{
+    /// getBestValue() calls, and the ones that found something new
+    STAT_GET_BEST_VALUE,
+    STAT_GET_BEST_VALUE_LOCKED,
+    /// Values given to the solver by getBestValue()
+    STAT_VALUES_ACCEPTED,
+    /// Incumbents reported by the solvers, and the ones better than the best
+    STAT_INCUMBENTS_FOUND,
+    STAT_INCUMBENTS_BETTER,
+    /// Incumbent messages written, fewer than the better ones if coalesced
+    STAT_INCUMBENTS_SENT,
+    /// Values with or without a solution from Erlang, and the ones no better
+    STAT_VALUES_RECEIVED,
+    STAT_VALUES_IGNORED,
+    STAT_PROGRESS_SENT,
+    STAT_MESSAGES_SENT,
+    STAT_BYTES_SENT,
+    /// Calls of the solver's callbacks into the port: CBC node comparisons
+    /// and events, SCIP events
+    STAT_SOLVER_COMPARES,
+    STAT_SOLVER_EVENTS,
+    NUM_PORT_COUNTERS
+};
+
+enum PortTimer
+{
+    /// Time ErlPortInterface's mutex is held
+    TIMER_MUTEX_HOLD,
+    /// Time a message write waits for the channel's queue
+    TIMER_SEND,
+    /// Time spent in the solver's event callbacks
+    TIMER_SOLVER_EVENT,
+    NUM_PORT_TIMERS
+};
+
+unsigned long long portClockNs();
+
+void countPortEvent(PortCounter counter, unsigned long long n = 1);
+
+void recordPortTime(PortTimer timer, unsigned long long ns);
+
+/// Records the time from construction to destruction
+class PortTimerScope
+{
+ public:
+    explicit PortTimerScope(PortTimer timer)
+        : _timer(timer), _start(portClockNs())
+    {
+    }
+
+    ~PortTimerScope()
+    {
+        recordPortTime(_timer, portClockNs() - _start);
+    }
+
+ private:
+    PortTimer _timer;
+    unsigned long long _start;
+};
+
+/**
+ * One line of JSON with the sums over all threads: the counters by name,
+ * then count, total, max and the 50th and 99th percentiles (upper bounds
+ * of their buckets) of each timer.
+ */
+std::string formatPortStats();
+
+/// Prints ">>> port stats: <formatPortStats()>" to stderr
+void printPortStats();
+
+#endif // __PORTSTATS_H__
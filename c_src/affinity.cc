@@ -0,0 +1,85 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "affinity.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+bool parseCpuList(const char *text, std::vector<int> &cpus)
+{
+    cpus.clear();
+    const char *p = text;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+        {
+            return false;
+        }
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+            {
+                return false;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+        if (*p == ',')
+        {
+            ++p;
+        }
+        else if (*p)
+        {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+#ifdef __linux__
+
+bool setThreadAffinity(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        if (cpus[i] >= CPU_SETSIZE)
+        {
+            fprintf(stderr, ">>> CPU %d is out of range\n", cpus[i]);
+            return false;
+        }
+        CPU_SET(cpus[i], &set);
+    }
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret)
+    {
+        fprintf(stderr, ">>> pthread_setaffinity_np() failed: %s\n", strerror(ret));
+        return false;
+    }
+    return true;
+}
+
+#else
+
+bool setThreadAffinity(const std::vector<int> &cpus)
+{
+    fprintf(stderr, ">>> CPU affinity is not supported on this platform\n");
+    return false;
+}
+
+#endif
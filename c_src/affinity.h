@@ -0,0 +1,25 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Pinning of the port threads to the CPUs the slave gave the port. Linux
+ * allocates a page on the NUMA node of the CPU that first touches it, so
+ * pinned threads also get their memory from the local node.
+ */
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <vector>
+
+/// Parses a list like "0,2,4-7", returns false if it is malformed
+bool parseCpuList(const char *text, std::vector<int> &cpus);
+
+/**
+ * Restricts the calling thread to the CPUs, the threads it creates later
+ * inherit them. Returns false with a message if that isn't possible, the
+ * thread then runs anywhere as before.
+ */
+bool setThreadAffinity(const std::vector<int> &cpus);
+
+#endif // __AFFINITY_H__
@@ -4,7 +4,13 @@
  */
 
 #include "ErlPortInterface.h"
+#include "delta.h"
+#include "LogSink.h"
+#include "ModelImage.h"
+#include "affinity.h"
+#include "PortStats.h"
 
+#include <algorithm>
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
@@ -16,9 +22,15 @@
 #include "CbcModel.hpp"
 #include "OsiClpSolverInterface.hpp"
 #include "CbcCompareDefault.hpp"
+#include "CbcEventHandler.hpp"
 
 int g_stdoutFd = 1;
 
+/// With -z the solver output read from the pipe is compressed to the log
+LogSink g_logSink;
+bool g_compressLog = false;
+bool g_forwardLog = false;
+
 ErlPortInterface g_portInterface;
 
 void sendResult(CbcModel &model, double result)
@@ -38,15 +50,130 @@ void sendResult(CbcModel &model, double result)
     g_portInterface.writeResult("stopped", result);
 }
 
+/**
+ * The incumbent value known to the threads of a CBC run. With -threads CBC
+ * clones the node comparison and the event handler into a model per thread,
+ * so the clones only ratchet this value down and each applies it to the
+ * model of its own thread, never to a model another thread is solving.
+ */
+class SharedBound
+{
+public:
+    SharedBound()
+        : _value(COIN_DBL_MAX), _hasSolution(0)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+    }
+
+    double get()
+    {
+        double value;
+        __atomic_load(&_value, &value, __ATOMIC_ACQUIRE);
+        return value;
+    }
+
+    void ratchet(double value)
+    {
+        double old = get();
+        while (isBetter(old, value)
+            && !__atomic_compare_exchange(&_value, &old, &value, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+        }
+    }
+
+    /// A solution from Erlang for the main model to check
+    void setSolution(double value, const std::vector<double> &x)
+    {
+        pthread_mutex_lock(&_mutex);
+        _solutionValue = value;
+        _solution = x;
+        __atomic_store_n(&_hasSolution, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&_mutex);
+        ratchet(value);
+    }
+
+    bool takeSolution(double &value, std::vector<double> &x)
+    {
+        // Called for every node, so only lock when there is one
+        if (__atomic_load_n(&_hasSolution, __ATOMIC_ACQUIRE) == 0)
+        {
+            return false;
+        }
+        pthread_mutex_lock(&_mutex);
+        value = _solutionValue;
+        x.swap(_solution);
+        _solution.clear();
+        __atomic_store_n(&_hasSolution, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&_mutex);
+        return true;
+    }
+
+private:
+    double _value;
+    pthread_mutex_t _mutex;
+    int _hasSolution;
+    double _solutionValue;
+    std::vector<double> _solution;
+};
+
+SharedBound g_bound;
+
+pthread_t g_mainThread;
+
+/**
+ * The model CbcMain() runs B&B on in the main thread takes the incumbents
+ * from Erlang with their solutions, the models of the other threads and
+ * the sub-B&B of heuristics only have their cutoff tightened. applied is
+ * the last value taken by the caller's model.
+ */
+void applyBound(CbcModel *model, double &applied)
+{
+    bool master = pthread_equal(pthread_self(), g_mainThread)
+        && model->parentModel() == NULL;
+    double value;
+    std::vector<double> x;
+    if (master && g_bound.takeSolution(value, x))
+    {
+        // CBC checks the solution and drops it if infeasible, columns only
+        // match without preprocessing
+        if ((int)x.size() == model->getNumCols())
+        {
+            model->setBestSolution(&(x[0]), x.size(), value, true);
+        }
+    }
+
+    value = g_bound.get();
+    if (!isBetter(applied, value))
+    {
+        return;
+    }
+    applied = value;
+    if (master)
+    {
+        if (isBetter(model->getObjValue(), value))
+        {
+            model->setBestSolution(NULL, 0, value);
+        }
+    }
+    else if (isBetter(model->getCutoff(), value))
+    {
+        model->setCutoff(value);
+    }
+}
+
+/// Polls the port for incumbents from Erlang for every node compared
 class MyCbcCompare : public CbcCompareBase, public BestValueAcceptor
 {
 public:
-    MyCbcCompare(CbcModel *model)
+    MyCbcCompare()
+        : _applied(COIN_DBL_MAX)
     {
-        _model = model;
     }
+
     bool test(CbcNode *x, CbcNode *y)
     {
+        countPortEvent(STAT_SOLVER_COMPARES);
         g_portInterface.getBestValue(*this);
         return _cmp.test(x, y);
     }
@@ -54,97 +181,235 @@ public:
     bool newSolution(CbcModel *model, double objectiveAtContinuous,
         int numberInfeasibilitiesAtContinuous)
     {
-        _model = model;
         g_portInterface.getBestValue(*this);
+        applyBound(model, _applied);
         return _cmp.newSolution(model, objectiveAtContinuous,
             numberInfeasibilitiesAtContinuous);
     }
 
     bool every1000Nodes(CbcModel *model, int numberNodes)
     {
-        _model = model;
         g_portInterface.getBestValue(*this);
+        applyBound(model, _applied);
         return _cmp.every1000Nodes(model, numberNodes);
     }
 
     CbcCompareBase *clone() const
     {
-        MyCbcCompare *result = new MyCbcCompare(*this);
-        result->_model = _model;
-        return result;
+        return new MyCbcCompare(*this);
     }
 
     void acceptNewBestValue(double bestVal)
     {
-        _model->setBestSolution(NULL, 0, bestVal);
+        g_bound.ratchet(bestVal);
+    }
+
+    void acceptNewBestSolution(double bestVal, const std::vector<double> &x)
+    {
+        g_bound.setSolution(bestVal, x);
     }
 
 private:
     CbcCompareDefault _cmp;
-    CbcModel *_model;
+    double _applied;
 };
 
-void processLine(const char *line)
+/**
+ * Reports every new incumbent with its exact value as soon as CBC stores it,
+ * and applies the shared incumbent to its model for every node
+ */
+class MyEventHandler : public CbcEventHandler
 {
-    const char *solString = "Integer solution of";
-    const char *p = strstr(line, solString);
-    if (p != NULL)
+public:
+    MyEventHandler(CbcModel *model, const BestValueAcceptor *source)
+        : CbcEventHandler(model), _source(source), _applied(COIN_DBL_MAX)
     {
-        const char *incumbentValue = p + strlen(solString);
-        g_portInterface.setBestValue(atof(incumbentValue), true);
     }
-}
+
+    CbcAction event(CbcEvent whichEvent)
+    {
+        countPortEvent(STAT_SOLVER_EVENTS);
+        PortTimerScope timer(TIMER_SOLVER_EVENT);
+        // Ends as after a limit, so the result and the solution are written
+        if (whichEvent == node && g_portInterface.isCancelled())
+        {
+            model_->sayEventHappened();
+            return stop;
+        }
+        if (whichEvent == node)
+        {
+            applyBound(model_, _applied);
+        }
+        // Node bounds in CBC are diffs against the preprocessed model, so
+        // none are given up, but the request is answered
+        if (whichEvent == node && g_portInterface.takeExportRequest() > 0)
+        {
+            g_portInterface.sendExportedNodes(std::vector<std::string>());
+        }
+        // The nodes of the other threads are counted into the main model's
+        if (whichEvent == node && pthread_equal(pthread_self(), g_mainThread)
+            && model_->parentModel() == NULL)
+        {
+            g_portInterface.reportProgress(*_source,
+                model_->getBestPossibleObjValue(), model_->getNodeCount(),
+                model_->tree()->size());
+        }
+        if (whichEvent == solution || whichEvent == heuristicSolution)
+        {
+            // The other threads take it from the shared value, Erlang and
+            // the other solvers from the port. Columns only match the
+            // stub's variables without preprocessing.
+            g_bound.ratchet(model_->getObjValue());
+            _applied = std::min(_applied, model_->getObjValue());
+            g_portInterface.setBestSolution(model_->getObjValue(),
+                model_->bestSolution(), model_->getNumCols());
+        }
+        return noAction;
+    }
+
+    CbcEventHandler *clone() const
+    {
+        return new MyEventHandler(*this);
+    }
+
+private:
+    /// The node comparison of main(), progress is reported as its solver's
+    const BestValueAcceptor *_source;
+    double _applied;
+};
 
 void *pipeReaderLoop(void *arg)
 {
-    char buf[1024];
-    int tail = 0;
+    char buf[4096];
     do
     {
-        int ret = read((int)(long)arg, buf + tail, sizeof(buf) - tail - 1);
-        if (ret <= 0)
+        int ret = read((int)(long)arg, buf, sizeof(buf));
+        if (ret == 0)
+        {
+            return NULL;
+        }
+        if (ret < 0)
         {
             fprintf(stderr, "read() from pipe failed: %s\n", strerror(errno));
             exit(1);
         }
-        
-        write(g_stdoutFd, buf, ret);
-        
-        int start = 0;
-        for (int i = 0; i < ret; ++i)
+
+        if (g_compressLog)
         {
-            if (buf[i] == '\n')
-            {
-                buf[i] = '\0';
-                processLine(buf + start);
-                start = i + 1;
-            }
+            g_logSink.write(buf, ret);
         }
-        int tail = ret - start;
-        if (tail > 0)
+        if (g_forwardLog)
         {
-            memmove(buf, buf + start, tail);
+            write(g_stdoutFd, buf, ret);
         }
     }
     while (true);
 }
 
+/// Loads the image with the bounds of the delta, as CbcMain() would the stub
+static bool loadImage(OsiClpSolverInterface &solver, const ModelImage &image,
+    const Bounds &bounds)
+{
+    int n = image.numVars();
+    int m = image.numCons();
+    double inf = solver.getInfinity();
+    std::vector<double> varLb(n), varUb(n), conLb(m), conUb(m);
+    for (int i = 0; i < n; ++i)
+    {
+        varLb[i] = std::max(-inf, image.varLb()[i]);
+        varUb[i] = std::min(inf, image.varUb()[i]);
+    }
+    for (int c = 0; c < m; ++c)
+    {
+        conLb[c] = std::max(-inf, image.conLb()[c]);
+        conUb[c] = std::min(inf, image.conUb()[c]);
+    }
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        const VarBound &b = bounds[i];
+        if (b.var < 0 || b.var >= n)
+        {
+            fprintf(stderr, "Variable %d out of range in delta\n", b.var);
+            return false;
+        }
+        varLb[b.var] = std::max(varLb[b.var], b.lb);
+        varUb[b.var] = std::min(varUb[b.var], b.ub);
+    }
+
+    std::vector<CoinBigIndex> rowStart(m + 1);
+    std::vector<int> rowLength(m);
+    for (int c = 0; c < m; ++c)
+    {
+        rowStart[c] = image.rowStart()[c];
+        rowLength[c] = image.rowStart()[c + 1] - image.rowStart()[c];
+    }
+    rowStart[m] = image.rowStart()[m];
+    CoinPackedMatrix matrix(false, n, m, rowStart[m], image.values(),
+        image.colIndex(), &(rowStart[0]), &(rowLength[0]));
+
+    double dummy = 0;
+    solver.loadProblem(matrix, n > 0 ? &(varLb[0]) : &dummy,
+        n > 0 ? &(varUb[0]) : &dummy, image.obj(),
+        m > 0 ? &(conLb[0]) : &dummy, m > 0 ? &(conUb[0]) : &dummy);
+    for (int i = 0; i < n; ++i)
+    {
+        if (image.isInteger(i))
+        {
+            solver.setInteger(i);
+        }
+    }
+    solver.setObjSense(image.minimize() ? 1 : -1);
+    // Osi subtracts the offset from c'x
+    solver.setDblParam(OsiObjOffset, -image.objConstant());
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     signal(SIGINT, SIG_IGN);
+    g_mainThread = pthread_self();
 
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <AMPL stub path> [-p] [-o <log file>] [-b <best solution value>] [-- CBC args]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <AMPL stub path> [-p | -P] [-o <log file>] [-b <best solution value>] [-d <delta file>] [-w <seconds between incumbents>] [-r <seconds between progress reports>] [-L] [-z] [-V <verbosity>] [-m <model image>] [-a <CPU list>] [-s] [-- CBC args]\n", argv[0]);
         return 1;
     }
 
+    // CbcModel copies the solver, so an image is loaded before the model is made
+    const char *imageFileName = NULL;
+    const char *deltaFileName = NULL;
+    for (char **q = argv; *q && strcmp(*q, "--"); ++q)
+    {
+        if (!strcmp(*q, "-m") && *(q + 1))
+        {
+            imageFileName = *(q + 1);
+        }
+        if (!strcmp(*q, "-d") && *(q + 1))
+        {
+            deltaFileName = *(q + 1);
+        }
+    }
+
+    ModelImage image;
     OsiClpSolverInterface solver;
+    if (imageFileName != NULL)
+    {
+        std::string base;
+        Bounds bounds;
+        if (!image.map(imageFileName)
+            || (deltaFileName != NULL && !readDelta(deltaFileName, base, bounds))
+            || !loadImage(solver, image, bounds))
+        {
+            return 1;
+        }
+    }
     CbcModel model(solver);
 
     const char *logFileName = NULL;
+    const char *cpuList = NULL;
 
     bool usePort = false;
+    const char *verbosity = "1";
     bool haveInitialBestVal = false;
     double initialBestVal = 0;
 
@@ -156,12 +421,18 @@ int main(int argc, char **argv)
             haveInitialBestVal = true;
             initialBestVal = atof(*(p + 1));
             model.setBestSolution(NULL, 0, initialBestVal);
+            g_bound.ratchet(initialBestVal);
             ++p;
         }
         if (!strcmp(*p, "-p"))
         {
             usePort = true;
         }
+        if (!strcmp(*p, "-P"))
+        {
+            usePort = true;
+            g_portInterface.setProtocol(2);
+        }
         if (!strcmp(*p, "-q"))
         {
             g_portInterface.setQuiet(true);
@@ -171,10 +442,85 @@ int main(int argc, char **argv)
             logFileName = *(p + 1);
             ++p;
         }
+        if (!strcmp(*p, "-d") || !strcmp(*p, "-m"))
+        {
+            ++p;
+        }
+        if (!strcmp(*p, "-w"))
+        {
+            g_portInterface.setPublishInterval(atof(*(p + 1)));
+            ++p;
+        }
+        if (!strcmp(*p, "-r"))
+        {
+            g_portInterface.setProgressInterval(atof(*(p + 1)));
+            ++p;
+        }
+        if (!strcmp(*p, "-L"))
+        {
+            g_forwardLog = true;
+        }
+        if (!strcmp(*p, "-z"))
+        {
+            g_compressLog = true;
+        }
+        if (!strcmp(*p, "-V"))
+        {
+            verbosity = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-a"))
+        {
+            cpuList = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-s"))
+        {
+            g_portInterface.setSendStats(true);
+        }
+    }
+
+    // Before any thread is started, so the port and CBC threads inherit it
+    std::vector<int> cpus;
+    if (cpuList != NULL)
+    {
+        if (!parseCpuList(cpuList, cpus))
+        {
+            fprintf(stderr, "Bad CPU list %s\n", cpuList);
+            return 1;
+        }
+        setThreadAffinity(cpus);
     }
 
-    MyCbcCompare cmp(&model);
+    // CbcMain() reads the stub by itself, so expand the delta to <delta>.nl
+    std::string stubFileName(argv[1]);
+    if (imageFileName != NULL)
+    {
+        // The .sol file is still named after the stub CBC would read
+        if (deltaFileName != NULL)
+        {
+            stubFileName = deltaNameNL(deltaFileName);
+        }
+    }
+    else if (deltaFileName != NULL)
+    {
+        std::string base;
+        Bounds bounds;
+        stubFileName = deltaNameNL(deltaFileName);
+        if (!readDelta(deltaFileName, base, bounds)
+            || !writeNLWithBounds(argv[1], bounds, stubFileName))
+        {
+            return 1;
+        }
+    }
+
+    g_portInterface.setNumVars(imageFileName != NULL ? image.numVars()
+        : numVarsNL(stubFileName));
+
+    MyCbcCompare cmp;
     model.setNodeComparison(cmp);
+    MyEventHandler eventHandler(&model, &cmp);
+    model.passInEventHandler(&eventHandler);
 
     if (haveInitialBestVal)
     {
@@ -185,23 +531,42 @@ int main(int argc, char **argv)
         g_portInterface.initialize(usePort);
     }
 
-    int pipefds[2];
-    if (pipe(pipefds))
+    // A compressed log needs a file name
+    g_compressLog = g_compressLog && logFileName != NULL;
+    if (g_compressLog && !g_logSink.open(logFileName))
     {
-        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
         return 1;
     }
-    g_stdoutFd = dup(1);
-    dup2(pipefds[1], 1);
+
+    // Solver output goes through a pipe only if it has to be forwarded or
+    // compressed
+    int pipefds[2];
     pthread_t pipeReaderThread;
-    if (pthread_create(&pipeReaderThread, NULL, pipeReaderLoop, (void *)(long)pipefds[0]))
+    int oldStderr = -1;
+    bool usePipe = g_forwardLog || g_compressLog;
+    if (usePipe)
     {
-        return 1;
+        if (pipe(pipefds))
+        {
+            fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+            return 1;
+        }
+        g_stdoutFd = dup(1);
+        dup2(pipefds[1], 1);
+        if (g_compressLog)
+        {
+            oldStderr = dup(2);
+            dup2(pipefds[1], 2);
+        }
+        close(pipefds[1]);
+        if (pthread_create(&pipeReaderThread, NULL, pipeReaderLoop, (void *)(long)pipefds[0]))
+        {
+            return 1;
+        }
     }
 
     FILE *f = NULL;
-    int oldStdout, oldStderr;
-    if (logFileName != NULL)
+    if (logFileName != NULL && !g_compressLog)
     {
         f = fopen(logFileName, "w");
         if (f == NULL)
@@ -209,18 +574,24 @@ int main(int argc, char **argv)
             fprintf(stderr, "Failed to open %s for writing\n", logFileName);
             return 1;
         }
-        oldStdout = dup(g_stdoutFd);
         dup2(fileno(f), g_stdoutFd);
-        oldStderr = dup(2);
         dup2(fileno(f), 2);
     }
 
     std::vector<std::string> rawArgs;
     rawArgs.push_back("cbc");
-    rawArgs.push_back(argv[1]);
-    rawArgs.push_back("-AMPL");
-    rawArgs.push_back("wantsol=1");
-    rawArgs.push_back("log=1");
+    if (imageFileName != NULL)
+    {
+        rawArgs.push_back("-log");
+        rawArgs.push_back(verbosity);
+    }
+    else
+    {
+        rawArgs.push_back(stubFileName);
+        rawArgs.push_back("-AMPL");
+        rawArgs.push_back("wantsol=1");
+        rawArgs.push_back(std::string("log=") + verbosity);
+    }
     if (*p)
     {
         for (++p; *p; ++p)
@@ -228,6 +599,12 @@ int main(int argc, char **argv)
             rawArgs.push_back(*p);
         }
     }
+    // Only the AMPL mode solves by itself
+    if (imageFileName != NULL)
+    {
+        rawArgs.push_back("-solve");
+        rawArgs.push_back("-quit");
+    }
 
     std::vector<const char *> args;
     for (size_t i = 0; i < rawArgs.size(); ++i)
@@ -241,8 +618,43 @@ int main(int argc, char **argv)
     fflush(stdout);
     fflush(stderr);
 
+    if (usePipe)
+    {
+        // The reader sees the end once both ends given to CBC are closed
+        close(1);
+        if (oldStderr >= 0)
+        {
+            dup2(oldStderr, 2);
+            close(oldStderr);
+        }
+        pthread_join(pipeReaderThread, NULL);
+        g_logSink.close();
+    }
+
     fprintf(stderr, ">>> CbcMain: %d %d %d\n", res, model.status(), model.secondaryStatus());
 
+    if (imageFileName != NULL)
+    {
+        // Columns only match without preprocessing
+        const double *x = model.getNumCols() == image.numVars()
+            ? model.bestSolution() : NULL;
+        const char *message = "CBC: limit reached";
+        int solveResult = 400;
+        if (model.isProvenOptimal())
+        {
+            message = "CBC: optimal solution found";
+            solveResult = 0;
+        }
+        else if (model.isProvenInfeasible())
+        {
+            message = "CBC: problem is infeasible";
+            solveResult = 200;
+        }
+        image.writeSolution(solNameNL(stubFileName), message, x, solveResult);
+    }
+
+    g_portInterface.reportProgress(cmp, model.getBestPossibleObjValue(),
+        model.getNodeCount(), 0);
     sendResult(model, model.getObjValue());
 
     fflush(stderr);
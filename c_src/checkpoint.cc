@@ -0,0 +1,304 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "checkpoint.h"
+#include "ErlPortInterface.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+bool writeCheckpoint(const std::string &path, const Checkpoint &checkpoint)
+{
+    std::string tmpPath(path + ".tmp");
+    FILE *f = fopen(tmpPath.c_str(), "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", tmpPath.c_str());
+        return false;
+    }
+    if (checkpoint.hasIncumbent)
+    {
+        fprintf(f, "incumbent %.17g\n", checkpoint.incumbent);
+    }
+    if (checkpoint.hasSolution)
+    {
+        fprintf(f, "solution %s %s\n", checkpoint.nlfile.c_str(),
+            checkpoint.solFileName.c_str());
+        for (size_t i = 0; i < checkpoint.x.size(); ++i)
+        {
+            if (checkpoint.x[i] != 0)
+            {
+                fprintf(f, "x %lu %.17g\n", i, checkpoint.x[i]);
+            }
+        }
+    }
+    for (size_t i = 0; i < checkpoint.nodes.size(); ++i)
+    {
+        const CheckpointNode &node = checkpoint.nodes[i];
+        fprintf(f, "node %s %s\n", node.nlfile.c_str(),
+            node.solFileName.c_str());
+        for (size_t j = 0; j < node.bounds.size(); ++j)
+        {
+            fprintf(f, "b %d %.17g %.17g\n", node.bounds[j].var,
+                node.bounds[j].lb, node.bounds[j].ub);
+        }
+    }
+    if (fclose(f) != 0 || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        fprintf(stderr, "Failed to write %s\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool readCheckpoint(const std::string &path, Checkpoint &checkpoint)
+{
+    std::ifstream f(path.c_str());
+    if (!f)
+    {
+        return false;
+    }
+
+    checkpoint = Checkpoint();
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream s(line);
+        std::string kind;
+        s >> kind;
+        if (kind == "incumbent")
+        {
+            std::string value;
+            s >> value;
+            checkpoint.hasIncumbent = true;
+            checkpoint.incumbent = strtod(value.c_str(), NULL);
+        }
+        else if (kind == "solution")
+        {
+            s >> checkpoint.nlfile >> checkpoint.solFileName;
+            checkpoint.hasSolution = true;
+        }
+        else if (kind == "x" && checkpoint.hasSolution)
+        {
+            size_t i;
+            std::string value;
+            s >> i >> value;
+            if (!s)
+            {
+                fprintf(stderr, "Wrong solution value in %s: %s\n",
+                    path.c_str(), line.c_str());
+                return false;
+            }
+            if (i >= checkpoint.x.size())
+            {
+                checkpoint.x.resize(i + 1, 0.);
+            }
+            checkpoint.x[i] = strtod(value.c_str(), NULL);
+        }
+        else if (kind == "node")
+        {
+            CheckpointNode node;
+            s >> node.nlfile >> node.solFileName;
+            checkpoint.nodes.push_back(node);
+        }
+        else if (kind == "b" && !checkpoint.nodes.empty())
+        {
+            VarBound b;
+            std::string lb, ub;
+            s >> b.var >> lb >> ub;
+            if (!s)
+            {
+                fprintf(stderr, "Wrong bound in %s: %s\n", path.c_str(),
+                    line.c_str());
+                return false;
+            }
+            // istream doesn't parse infinities
+            b.lb = strtod(lb.c_str(), NULL);
+            b.ub = strtod(ub.c_str(), NULL);
+            checkpoint.nodes.back().bounds.push_back(b);
+        }
+    }
+    // An empty file, as staged for a task not run yet, has nothing to resume
+    return !checkpoint.nodes.empty();
+}
+
+/// The box of bounds holding both a and b, a variable bounded in only
+/// one of them is left to its original bounds
+static Bounds mergeBounds(const Bounds &a, const Bounds &b)
+{
+    Bounds result;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        for (size_t j = 0; j < b.size(); ++j)
+        {
+            if (a[i].var == b[j].var)
+            {
+                VarBound bound = {a[i].var, std::min(a[i].lb, b[j].lb),
+                                  std::max(a[i].ub, b[j].ub)};
+                result.push_back(bound);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+void mergeCheckpointNodes(CheckpointNodes &nodes, size_t maxNodes)
+{
+    if (maxNodes == 0)
+    {
+        maxNodes = 1;
+    }
+    // Every pass halves the nodes of each stub
+    while (nodes.size() > maxNodes)
+    {
+        CheckpointNodes merged;
+        std::vector<bool> done(nodes.size(), false);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            if (done[i])
+            {
+                continue;
+            }
+            CheckpointNode node = nodes[i];
+            for (size_t j = i + 1; j < nodes.size(); ++j)
+            {
+                if (!done[j] && nodes[j].nlfile == node.nlfile
+                    && nodes[j].solFileName == node.solFileName)
+                {
+                    node.bounds = mergeBounds(node.bounds, nodes[j].bounds);
+                    done[j] = true;
+                    break;
+                }
+            }
+            merged.push_back(node);
+        }
+        if (merged.size() == nodes.size())
+        {
+            break;
+        }
+        nodes.swap(merged);
+    }
+}
+
+CheckpointWriter::CheckpointWriter(const std::string &path, double interval,
+    size_t maxNodes)
+    : _path(path), _interval(interval), _maxNodes(maxNodes),
+      _lastWrite(time(NULL)), _pending(false), _stop(false), _removed(false)
+{
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+    pthread_mutex_init(&_fileMutex, NULL);
+    int ret;
+    if ((ret = pthread_create(&_thread, NULL, writerLoop, this)))
+    {
+        fprintf(stderr, ">>> pthread_create() failed with %d\n", ret);
+        exit(1);
+    }
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    pthread_mutex_lock(&_mutex);
+    _stop = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    pthread_join(_thread, NULL);
+    pthread_mutex_destroy(&_fileMutex);
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void *CheckpointWriter::writerLoop(void *arg)
+{
+    CheckpointWriter *This = (CheckpointWriter *)arg;
+    pthread_mutex_lock(&This->_mutex);
+    while (!This->_stop)
+    {
+        if (!This->_pending)
+        {
+            pthread_cond_wait(&This->_cond, &This->_mutex);
+            continue;
+        }
+        This->_pending = false;
+        pthread_mutex_unlock(&This->_mutex);
+        This->write();
+        pthread_mutex_lock(&This->_mutex);
+    }
+    pthread_mutex_unlock(&This->_mutex);
+    return NULL;
+}
+
+bool CheckpointWriter::isDue() const
+{
+    return time(NULL) - __atomic_load_n(&_lastWrite, __ATOMIC_RELAXED) >= _interval;
+}
+
+void CheckpointWriter::setNodes(size_t slot, const CheckpointNodes &nodes)
+{
+    pthread_mutex_lock(&_mutex);
+    _slots[slot] = nodes;
+    pthread_mutex_unlock(&_mutex);
+}
+
+void CheckpointWriter::setIncumbent(double value, const std::string &nlfile,
+    const std::string &solFileName, const std::vector<double> &x)
+{
+    pthread_mutex_lock(&_mutex);
+    if (!_checkpoint.hasIncumbent || isBetter(_checkpoint.incumbent, value)
+        || (!_checkpoint.hasSolution && !nlfile.empty()
+            && _checkpoint.incumbent == value))
+    {
+        _checkpoint.hasIncumbent = true;
+        _checkpoint.incumbent = value;
+        _checkpoint.hasSolution = !nlfile.empty();
+        _checkpoint.nlfile = nlfile;
+        _checkpoint.solFileName = solFileName;
+        _checkpoint.x = x;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void CheckpointWriter::requestWrite()
+{
+    pthread_mutex_lock(&_mutex);
+    _pending = true;
+    // Not due again while the thread writes
+    __atomic_store_n(&_lastWrite, (long)time(NULL), __ATOMIC_RELAXED);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool CheckpointWriter::write()
+{
+    pthread_mutex_lock(&_fileMutex);
+    pthread_mutex_lock(&_mutex);
+    Checkpoint checkpoint(_checkpoint);
+    for (std::map<size_t, CheckpointNodes>::const_iterator it = _slots.begin();
+         it != _slots.end(); ++it)
+    {
+        checkpoint.nodes.insert(checkpoint.nodes.end(), it->second.begin(),
+            it->second.end());
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    mergeCheckpointNodes(checkpoint.nodes, _maxNodes);
+    bool result = _removed || writeCheckpoint(_path, checkpoint);
+    __atomic_store_n(&_lastWrite, (long)time(NULL), __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&_fileMutex);
+    return result;
+}
+
+void CheckpointWriter::remove()
+{
+    pthread_mutex_lock(&_fileMutex);
+    _removed = true;
+    ::remove(_path.c_str());
+    pthread_mutex_unlock(&_fileMutex);
+}
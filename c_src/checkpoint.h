@@ -0,0 +1,123 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Checkpoint of a solve: the incumbent and the open nodes, each as the
+ * stub it belongs to and its variable bounds.
+ *
+ * The file is text: an optional "incumbent <value>" line, optionally
+ * followed by a "solution <stub> <solution file>" line and the nonzeros of
+ * the incumbent as "x <variable> <value>" lines, then for every node a
+ * "node <stub> <solution file>" line followed by its
+ * "b <variable> <lower> <upper>" lines.
+ */
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include "delta.h"
+
+#include <map>
+#include <pthread.h>
+
+struct CheckpointNode
+{
+    std::string nlfile;
+    std::string solFileName;
+    Bounds bounds;
+};
+
+typedef std::vector<CheckpointNode> CheckpointNodes;
+
+/// Open nodes a solver stores at most, more are merged into their ancestors
+#define CHECKPOINT_NODES_PER_SOLVER 16
+
+struct Checkpoint
+{
+    Checkpoint()
+        : hasIncumbent(false), incumbent(0), hasSolution(false)
+    {
+    }
+    bool hasIncumbent;
+    double incumbent;
+    /// The incumbent vector and the stub it solves, if known
+    bool hasSolution;
+    std::string nlfile;
+    std::string solFileName;
+    std::vector<double> x;
+    CheckpointNodes nodes;
+};
+
+/// Writes to a temporary file renamed over path, so a kill leaves either
+bool writeCheckpoint(const std::string &path, const Checkpoint &checkpoint);
+
+/// Returns false if there is no checkpoint or it has no nodes
+bool readCheckpoint(const std::string &path, Checkpoint &checkpoint);
+
+/**
+ * Replaces nodes of the same stub by the smallest box of bounds holding
+ * them until at most maxNodes are left. Neighbours in the list are merged,
+ * solvers store their nodes in tree order.
+ */
+void mergeCheckpointNodes(CheckpointNodes &nodes, size_t maxNodes);
+
+/**
+ * Collects the open nodes of the solvers of a process and writes them
+ * out at most once per interval. Every solver has a slot, a solver stores
+ * the whole subproblem first and its open nodes when asked to. An old
+ * frontier still covers the newer one, so slots need not be current.
+ *
+ * Solvers only hand over their nodes, a thread of the writer merges them
+ * down to maxNodes and writes the file.
+ */
+class CheckpointWriter
+{
+ public:
+    CheckpointWriter(const std::string &path, double interval,
+        size_t maxNodes);
+
+    ~CheckpointWriter();
+
+    /// Cheap, returns true if the interval since the last write is over
+    bool isDue() const;
+
+    void setNodes(size_t slot, const CheckpointNodes &nodes);
+
+    /// Keeps the solution if its value is better than the stored one, an
+    /// empty nlfile stores the value only
+    void setIncumbent(double value, const std::string &nlfile,
+        const std::string &solFileName, const std::vector<double> &x);
+
+    /// Has the checkpoint written by the thread of the writer
+    void requestWrite();
+
+    /// Writes the checkpoint now
+    bool write();
+
+    /// The solve is over, nothing to resume
+    void remove();
+
+ private:
+    std::string _path;
+    double _interval;
+    size_t _maxNodes;
+    /// Seconds since the epoch, read without the mutex
+    long _lastWrite;
+    Checkpoint _checkpoint;
+    std::map<size_t, CheckpointNodes> _slots;
+    bool _pending;
+    bool _stop;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    /// Orders the writes of the file and its removal
+    pthread_mutex_t _fileMutex;
+    bool _removed;
+    pthread_t _thread;
+
+    static void *writerLoop(void *arg);
+
+    CheckpointWriter(const CheckpointWriter &);
+    CheckpointWriter &operator=(const CheckpointWriter &);
+};
+
+#endif // __CHECKPOINT_H__
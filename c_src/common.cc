@@ -4,21 +4,310 @@
  */
 
 #include "common.h"
+#include "ModelImage.h"
+#ifdef HAVE_CLP
+#include "LPRelaxation.h"
+#endif
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 
-typedef std::vector<mp::ProblemChanges> VecChanges;
+static void deleteLP(LPRelaxation *lp)
+{
+#ifdef HAVE_CLP
+    delete lp;
+#endif
+}
+
+std::string subproblemName(const std::string &prefix, size_t i,
+    const char *ext)
+{
+    std::vector<char> buf(prefix.size() + strlen(ext) + 32);
+    snprintf(&(buf[0]), buf.size(), "%s_%03lu%s", prefix.c_str(), i, ext);
+    return &(buf[0]);
+}
+
+SubproblemWriter::SubproblemWriter(const std::string &prefix,
+    mp::ASLProblem &p, int numThreads, SubproblemFormat format)
+    : _prefix(prefix), _problem(p), _format(format),
+      _maxQueued(2 * numThreads), _submitted(0), _nextToPrint(0),
+      _finishing(false), _leafBounds(false), _prune(false),
+      _hasIncumbent(false), _incumbent(0), _numPruned(0), _lp(NULL)
+{
+    if (_format != FORMAT_DELTA)
+    {
+        // A temporary base of its own, <prefix>-base.nl may be the base of
+        // the .delta files of an earlier run
+        std::string name(_prefix + "-bounds-XXXXXX.nl");
+        std::vector<char> buf(name.begin(), name.end());
+        buf.push_back('\0');
+        int fd = mkstemps(&(buf[0]), 3);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Failed to create %s: %s\n", name.c_str(),
+                strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        _baseName = &(buf[0]);
+    }
+    else
+    {
+        _baseName = _prefix + "-base.nl";
+    }
+    // Subproblems are the base patched as text, which the workers do in
+    // parallel; ASL writes one NL file at a time
+    _problem.WriteNL(_baseName, NULL, ASL_write_ASCII);
+    if (_format == FORMAT_DELTA)
+    {
+        std::cout << "Written " << _baseName << std::endl;
+    }
+
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_hasJob, NULL);
+    pthread_cond_init(&_hasSpace, NULL);
+
+    for (int i = 0; numThreads > 1 && i < numThreads; ++i)
+    {
+        pthread_t thread;
+        int ret;
+        if ((ret = pthread_create(&thread, NULL, workerLoop, this)))
+        {
+            fprintf(stderr, "pthread_create() failed with %d\n", ret);
+            exit(1);
+        }
+        _threads.push_back(thread);
+    }
+}
+
+SubproblemWriter::~SubproblemWriter()
+{
+    finish();
+    deleteLP(_lp);
+    pthread_cond_destroy(&_hasSpace);
+    pthread_cond_destroy(&_hasJob);
+    pthread_mutex_destroy(&_mutex);
+}
+
+void SubproblemWriter::setLeafBounds(bool leafBounds)
+{
+    _leafBounds = leafBounds;
+}
+
+void SubproblemWriter::setPruning(bool hasIncumbent, double incumbent)
+{
+    // Only the linear part is relaxed, with nonlinear terms it is no bound
+    if (_problem.num_nonlinear_objs() > 0 || _problem.num_nonlinear_cons() > 0
+        || _problem.num_logical_cons() > 0)
+    {
+        fprintf(stderr, "The problem is not linear, no subproblems are pruned\n");
+        return;
+    }
+    _prune = true;
+    _hasIncumbent = hasIncumbent;
+    _incumbent = incumbent;
+}
+
+size_t SubproblemWriter::numPruned() const
+{
+    return _numPruned;
+}
+
+void SubproblemWriter::write(const Bounds &bounds)
+{
+    if (_threads.empty())
+    {
+        if (_lp == NULL)
+        {
+            _lp = createLP();
+        }
+        Job job(_submitted++, bounds);
+        printWritten(job.index, writeJob(job, _lp));
+        return;
+    }
+
+    Job *job = new Job(0, bounds);
+    pthread_mutex_lock(&_mutex);
+    while (_queue.size() >= _maxQueued)
+    {
+        pthread_cond_wait(&_hasSpace, &_mutex);
+    }
+    job->index = _submitted++;
+    _queue.push_back(job);
+    pthread_cond_signal(&_hasJob);
+    pthread_mutex_unlock(&_mutex);
+}
 
-void writeChanged(const std::string &prefix, mp::ASLProblem &p,
-    VecChanges changes)
+void SubproblemWriter::finish()
 {
-    for (size_t i = 0; i < changes.size(); ++i)
+    pthread_mutex_lock(&_mutex);
+    _finishing = true;
+    pthread_cond_broadcast(&_hasJob);
+    pthread_mutex_unlock(&_mutex);
+
+    for (size_t i = 0; i < _threads.size(); ++i)
+    {
+        pthread_join(_threads[i], NULL);
+    }
+    _threads.clear();
+
+    if (_prune && _submitted > 0)
     {
-        char buf[256];
-        sprintf(buf, "%s_%03lu.nl", prefix.c_str(), i);
-        p.WriteNL(buf, &(changes[i]));
-        std::cout << "Written " << buf << std::endl;
+        std::cout << "Pruned " << _numPruned << " of " << _submitted
+                  << " subproblems" << std::endl;
+        _prune = false;
+    }
+
+    if (_format != FORMAT_DELTA && !_baseName.empty())
+    {
+        remove(_baseName.c_str());
+        _baseName.clear();
+    }
+}
+
+void *SubproblemWriter::workerLoop(void *ptr)
+{
+    SubproblemWriter *This = (SubproblemWriter *)ptr;
+    LPRelaxation *lp = NULL;
+
+    while (true)
+    {
+        pthread_mutex_lock(&This->_mutex);
+        while (This->_queue.empty() && !This->_finishing)
+        {
+            pthread_cond_wait(&This->_hasJob, &This->_mutex);
+        }
+        if (This->_queue.empty())
+        {
+            pthread_mutex_unlock(&This->_mutex);
+            deleteLP(lp);
+            return NULL;
+        }
+        Job *job = This->_queue.front();
+        This->_queue.pop_front();
+        pthread_cond_signal(&This->_hasSpace);
+        pthread_mutex_unlock(&This->_mutex);
+
+        if (lp == NULL)
+        {
+            lp = This->createLP();
+        }
+        std::string name(This->writeJob(*job, lp));
+        size_t index = job->index;
+        delete job;
+
+        pthread_mutex_lock(&This->_mutex);
+        This->printWritten(index, name);
+        pthread_mutex_unlock(&This->_mutex);
+    }
+}
+
+LPRelaxation *SubproblemWriter::createLP()
+{
+    if (!_leafBounds && !_prune)
+    {
+        return NULL;
+    }
+#ifdef HAVE_CLP
+    return new LPRelaxation(_problem);
+#else
+    fprintf(stderr, "Leaf bounds and pruning need nlmod built with Clp\n");
+    exit(1);
+#endif
+}
+
+// Returns false if the leaf is pruned
+bool SubproblemWriter::checkLeaf(const Job &job, LPRelaxation *lp)
+{
+#ifdef HAVE_CLP
+    bool feasible = lp->solve(job.bounds);
+    bool infeasible = !feasible && lp->isProvenInfeasible();
+    double value = lp->objValue();
+
+    if (_leafBounds && (feasible || infeasible))
+    {
+        std::string name(subproblemName(_prefix, job.index, ".bound"));
+        FILE *f = fopen(name.c_str(), "w");
+        if (f == NULL)
+        {
+            fprintf(stderr, "Failed to open %s for writing\n", name.c_str());
+            exit(1);
+        }
+        fprintf(f, feasible ? "%.17g\n" : "inf\n", value);
+        fclose(f);
+    }
+
+    if (!_prune)
+    {
+        return true;
+    }
+    if (infeasible)
+    {
+        return false;
+    }
+    // Within the tolerance the ports use for a better value
+    bool maximize = _problem.num_objs() > 0
+        && _problem.obj_type(0) == mp::obj::MAX;
+    return !feasible || !_hasIncumbent
+        || (maximize ? value > _incumbent + 1e-6 : value < _incumbent - 1e-6);
+#else
+    return true;
+#endif
+}
+
+std::string SubproblemWriter::writeJob(Job &job, LPRelaxation *lp)
+{
+    if (lp != NULL && !checkLeaf(job, lp))
+    {
+        return std::string();
+    }
+
+    if (_format == FORMAT_DELTA)
+    {
+        std::string name(subproblemName(_prefix, job.index, ".delta"));
+        if (!writeDelta(name, _baseName, job.bounds))
+        {
+            exit(1);
+        }
+        return name;
+    }
+
+    std::string name(subproblemName(_prefix, job.index));
+    bool written = _format == FORMAT_NL_BOUNDS
+        ? writeNLWithBounds(_baseName, job.bounds, name)
+        : writeNLWithBoundRows(_baseName, job.bounds, name);
+    if (!written)
+    {
+        exit(1);
+    }
+    return name;
+}
+
+// Called with _mutex held, holds back files written out of order. A pruned
+// subproblem has no name.
+void SubproblemWriter::printWritten(size_t index, const std::string &name)
+{
+    _written[index] = name;
+    std::map<size_t, std::string>::iterator it;
+    while ((it = _written.find(_nextToPrint)) != _written.end())
+    {
+        if (it->second.empty())
+        {
+            ++_numPruned;
+        }
+        else
+        {
+            std::cout << "Written " << it->second << std::endl;
+        }
+        _written.erase(it);
+        ++_nextToPrint;
     }
 }
 
@@ -42,67 +331,124 @@ bool isInteger(const mp::ASLProblem &p, int variable)
     return p.var_type(variable) == mp::var::INTEGER;
 }
 
-VecChanges splitVariable(const mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int var)
+void getBounds(const mp::ASLProblem &p, const Bounds &bounds, int var,
+    double &lb, double &ub)
 {
-    int numValues = (int)(0.5 + (p.var_ub()[var] - p.var_lb()[var] + 1.));
-    VecChanges result(numValues, mp::ProblemChanges(p));
+    lb = p.var_lb()[var];
+    ub = p.var_ub()[var];
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        if (bounds[i].var == var)
+        {
+            lb = bounds[i].lb;
+            ub = bounds[i].ub;
+        }
+    }
+}
 
-    std::vector<double> coefs(p.num_vars(), 0.);
-    coefs[var] = 1.;
+// Returns a copy of bounds with the ones for var replaced
+static Bounds withBounds(const Bounds &bounds, int var, double lb, double ub)
+{
+    Bounds result(bounds);
+    for (size_t i = 0; i < result.size(); ++i)
+    {
+        if (result[i].var == var)
+        {
+            result[i].lb = lb;
+            result[i].ub = ub;
+            return result;
+        }
+    }
+    VarBound b = {var, lb, ub};
+    result.push_back(b);
+    return result;
+}
+
+VecBounds splitVariable(const mp::ASLProblem &p, const Bounds &bounds,
+    int var)
+{
+    double lb, ub;
+    getBounds(p, bounds, var, lb, ub);
+    int numValues = (int)(0.5 + (ub - lb + 1.));
+    VecBounds result;
 
     for (int i = 0; i < numValues; ++i)
     {
-        result[i].AddCon(&(coefs[0]), p.var_lb()[var] + i, p.var_lb()[var] + i);
-        printLog(i, var, p.var_lb()[var] + i, p.var_lb()[var] + i);
+        result.push_back(withBounds(bounds, var, lb + i, lb + i));
+        printLog(i, var, lb + i, lb + i);
     }
     return result;
 }
 
-VecChanges splitVariableHalfs(mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int var)
+VecBounds splitVariableHalfs(mp::ASLProblem &p, const Bounds &bounds,
+    int var)
 {
-    double middle = (p.var_ub()[var] - p.var_lb()[var]) / 2.;
-    double left = std::floor(p.var_lb()[var] + middle);
-    double right = std::floor(p.var_lb()[var] + middle + 1.);
+    double lb, ub;
+    getBounds(p, bounds, var, lb, ub);
+    double middle = (ub - lb) / 2.;
+    double left = std::floor(lb + middle);
+    double right = std::floor(lb + middle + 1.);
 
-    VecChanges result(2, mp::ProblemChanges(p));
-    std::vector<double> coefs(p.num_vars(), 0.);
-    coefs[var] = 1.;
-
-    result[0].AddCon(&(coefs[0]), p.var_lb()[var], left);
-    printLog(0, var, p.var_lb()[var], left);
-    result[1].AddCon(&(coefs[0]), right, p.var_ub()[var]);
-    printLog(0, var, right, p.var_ub()[var]);
+    VecBounds result;
+    result.push_back(withBounds(bounds, var, lb, left));
+    printLog(0, var, lb, left);
+    result.push_back(withBounds(bounds, var, right, ub));
+    printLog(1, var, right, ub);
 
     return result;
 }
 
-VecChanges splitVariableArgv(mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int argc, char **argv)
+int parseSplitVariable(const mp::ASLProblem &p, int argc, char **argv)
 {
     if (argc < 2)
     {
         std::cout << "Excessive parameters" << std::endl;
-        return VecChanges();
+        return -1;
     }
     int var = 0;
     if (!sscanf(argv[1], "%d", &var))
     {
         std::cout << "Argument " << argv[1] << " is not integer" << std::endl;
-        return VecChanges();
+        return -1;
     }
-    if (!isInteger(p, var))
+    if (var < 0 || var >= p.num_vars() || !isInteger(p, var))
     {
         std::cout << "Variable " << var << " is not integer" << std::endl;
-        return VecChanges();
+        return -1;
+    }
+    return var;
+}
+
+VecBounds splitVariableArgv(mp::ASLProblem &p, const Bounds &bounds,
+    int argc, char **argv)
+{
+    int var = parseSplitVariable(p, argc, argv);
+    if (var < 0)
+    {
+        return VecBounds();
     }
 
     if (!strcmp(argv[0], "split"))
     {
-        return splitVariable(p, mp::ProblemChanges(p), var);
+        return splitVariable(p, bounds, var);
+    }
+    return splitVariableHalfs(p, bounds, var);
+}
+
+void writeSplit(mp::ASLProblem &p, const Bounds &bounds, int argc,
+    char **argv, SubproblemWriter &writer)
+{
+    if (argc < 2)
+    {
+        writer.write(bounds);
+        return;
+    }
+
+    VecBounds children(splitVariableArgv(p, bounds, argc, argv));
+    for (size_t i = 0; i < children.size(); ++i)
+    {
+        writeSplit(p, children[i], argc - 2, argv + 2, writer);
     }
-    return splitVariableHalfs(p, mp::ProblemChanges(p), var);
 }
 
 std::string baseNameNL(const char *name)
@@ -120,3 +466,100 @@ std::string baseNameNL(const char *name)
     }
     return result;
 }
+
+// The options of the header and the constant of the linear objective, the
+// one expression after "O0 <sense>", ASL has no accessor for either
+static bool readNLHeader(const std::string &nlPath, ModelImageData &data)
+{
+    std::ifstream in(nlPath.c_str());
+    std::string line;
+    if (!std::getline(in, line) || line.empty() || line[0] != 'g')
+    {
+        std::cout << nlPath << " is not a text NL file" << std::endl;
+        return false;
+    }
+    std::istringstream header(line.substr(1));
+    int numOptions = 0;
+    header >> numOptions;
+    for (int i = 0; i < numOptions; ++i)
+    {
+        int option;
+        header >> option;
+        data.options.push_back(option);
+    }
+    if (numOptions >= 2 && data.options[1] == 3)
+    {
+        header >> data.vbtol;
+    }
+
+    while (std::getline(in, line))
+    {
+        if (line.compare(0, 3, "O0 ") == 0)
+        {
+            if (!std::getline(in, line) || line.empty() || line[0] != 'n')
+            {
+                std::cout << "Nonlinear objective in " << nlPath << std::endl;
+                return false;
+            }
+            data.objConstant = atof(line.c_str() + 1);
+            return true;
+        }
+    }
+    // No objective
+    return true;
+}
+
+bool writeImage(const mp::ASLProblem &p, const std::string &nlPath,
+    const std::string &path)
+{
+    if (p.num_nonlinear_objs() > 0 || p.num_nonlinear_cons() > 0
+        || p.num_logical_cons() > 0)
+    {
+        std::cout << "Model images are for linear problems only" << std::endl;
+        return false;
+    }
+    ModelImageData data;
+    if (!readNLHeader(nlPath, data))
+    {
+        return false;
+    }
+
+    int n = p.num_vars();
+    data.obj.resize(n, 0.);
+    if (p.num_objs() > 0)
+    {
+        mp::LinearObjExpr e = p.linear_obj_expr(0);
+        for (mp::LinearObjExpr::iterator i = e.begin(); i != e.end(); ++i)
+        {
+            data.obj[i->var_index()] = i->coef();
+        }
+        data.sense = p.obj_type(0) == mp::obj::MAX ? -1 : 1;
+    }
+    data.varLb.assign(p.var_lb(), p.var_lb() + n);
+    data.varUb.assign(p.var_ub(), p.var_ub() + n);
+    data.varInteger.resize(n);
+    data.varNames.resize(n);
+    for (int v = 0; v < n; ++v)
+    {
+        data.varInteger[v] = isInteger(p, v);
+        data.varNames[v] = p.var_name(v);
+    }
+
+    int m = p.num_cons();
+    data.conLb.assign(p.con_lb(), p.con_lb() + m);
+    data.conUb.assign(p.con_ub(), p.con_ub() + m);
+    data.conNames.resize(m);
+    data.rowStart.push_back(0);
+    for (int c = 0; c < m; ++c)
+    {
+        mp::LinearConExpr e = p.linear_con_expr(c);
+        for (mp::LinearConExpr::iterator i = e.begin(); i != e.end(); ++i)
+        {
+            data.colIndex.push_back(i->var_index());
+            data.values.push_back(i->coef());
+        }
+        data.rowStart.push_back(data.values.size());
+        data.conNames[c] = p.con_name(c);
+    }
+    return writeModelImage(path, data);
+}
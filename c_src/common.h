@@ -7,25 +7,157 @@
 #define __COMMON_H__
 
 #include "asl/aslproblem.h"
+#include "delta.h"
 
-typedef std::vector<mp::ProblemChanges> VecChanges;
+#include <deque>
+#include <map>
+#include <pthread.h>
 
-void writeChanged(const std::string &prefix, mp::ASLProblem &p,
-    VecChanges changes);
+/// A subproblem is the original problem with the variable bounds tightened
+typedef std::vector<Bounds> VecBounds;
+
+class LPRelaxation;
+
+enum SubproblemFormat
+{
+    /**
+     * Complete <prefix>_NNN.nl file per subproblem, bounds added as rows,
+     * patched from a temporary <prefix>-bounds-XXXXXX.nl
+     */
+    FORMAT_NL,
+    /**
+     * Complete <prefix>_NNN.nl file per subproblem with tightened bounds,
+     * patched from a temporary <prefix>-bounds-XXXXXX.nl
+     */
+    FORMAT_NL_BOUNDS,
+    /// Shared <prefix>-base.nl plus <prefix>_NNN.delta per subproblem
+    FORMAT_DELTA
+};
+
+/**
+ * Writes subproblems as <prefix>_NNN.nl or <prefix>_NNN.delta files.
+ *
+ * With more than one thread the files are written by a pool of workers
+ * fed through a bounded queue, so write() blocks when the workers fall
+ * behind. "Written" lines are printed in submission order. ASL writes one
+ * NL file at a time, so it writes only the base; the subproblems are text
+ * patches of it and are written in parallel.
+ *
+ * With leaf bounds each subproblem also gets a <prefix>_NNN.bound file with
+ * the objective value of its LP relaxation, "inf" if that is infeasible.
+ * With pruning subproblems with an infeasible LP relaxation, or one no
+ * better than the incumbent, are not written and leave a gap in the
+ * numbering.
+ */
+class SubproblemWriter
+{
+ public:
+    SubproblemWriter(const std::string &prefix, mp::ASLProblem &p,
+        int numThreads, SubproblemFormat format = FORMAT_NL);
+
+    ~SubproblemWriter();
+
+    /// Needs nlmod built with Clp, must be called before write()
+    void setLeafBounds(bool leafBounds);
+
+    /**
+     * Turns pruning on, for linear problems only. Needs nlmod built with
+     * Clp, must be called before write().
+     */
+    void setPruning(bool hasIncumbent, double incumbent);
+
+    /// Valid after finish()
+    size_t numPruned() const;
+
+    void write(const Bounds &bounds);
+
+    /// Waits until all submitted subproblems are written.
+    void finish();
+
+ private:
+    struct Job
+    {
+        Job(size_t index, const Bounds &bounds)
+            : index(index), bounds(bounds)
+        {
+        }
+        size_t index;
+        Bounds bounds;
+    };
+
+    std::string _prefix;
+    mp::ASLProblem &_problem;
+    SubproblemFormat _format;
+    std::string _baseName;
+    std::vector<pthread_t> _threads;
+    size_t _maxQueued;
+    size_t _submitted;
+    size_t _nextToPrint;
+    bool _finishing;
+    bool _leafBounds;
+    bool _prune;
+    bool _hasIncumbent;
+    double _incumbent;
+    size_t _numPruned;
+    /// Relaxation of write() without workers, each worker has its own
+    LPRelaxation *_lp;
+
+    std::deque<Job *> _queue;
+    std::map<size_t, std::string> _written;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _hasJob;
+    pthread_cond_t _hasSpace;
+
+    static void *workerLoop(void *);
+    std::string writeJob(Job &job, LPRelaxation *lp);
+    bool checkLeaf(const Job &job, LPRelaxation *lp);
+    LPRelaxation *createLP();
+    void printWritten(size_t index, const std::string &name);
+
+    SubproblemWriter(const SubproblemWriter &);
+    SubproblemWriter &operator=(const SubproblemWriter &);
+};
+
+std::string subproblemName(const std::string &prefix, size_t i,
+    const char *ext = ".nl");
 
 const char *getVarType(const mp::ASLProblem &p, int variable);
 
 bool isInteger(const mp::ASLProblem &p, int variable);
 
-VecChanges splitVariable(const mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int var);
+/// Returns the bounds of the variable in the subproblem
+void getBounds(const mp::ASLProblem &p, const Bounds &bounds, int var,
+    double &lb, double &ub);
+
+VecBounds splitVariable(const mp::ASLProblem &p, const Bounds &bounds,
+    int var);
+
+VecBounds splitVariableHalfs(mp::ASLProblem &p, const Bounds &bounds,
+    int var);
 
-VecChanges splitVariableHalfs(mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int var);
+/// Returns the variable of a <split | halfs> <variable> pair or -1
+int parseSplitVariable(const mp::ASLProblem &p, int argc, char **argv);
 
-VecChanges splitVariableArgv(mp::ASLProblem &p,
-    const mp::ProblemChanges &changes, int argc, char **argv);
+VecBounds splitVariableArgv(mp::ASLProblem &p, const Bounds &bounds,
+    int argc, char **argv);
+
+/**
+ * Applies the <split | halfs> <variable> pairs to the subproblem depth
+ * first and writes each leaf as soon as it is complete. Only the current
+ * path of the split tree is kept in memory, the leaves come out in the
+ * same order as splitting the whole tree level by level.
+ */
+void writeSplit(mp::ASLProblem &p, const Bounds &bounds, int argc,
+    char **argv, SubproblemWriter &writer);
 
 std::string baseNameNL(const char *name);
 
+/**
+ * Writes the model image of a linear problem read from the text NL file at
+ * nlPath, see ModelImage.h. Returns false with a message for nonlinear
+ * problems and binary NL files.
+ */
+bool writeImage(const mp::ASLProblem &p, const std::string &nlPath,
+    const std::string &path);
+
 #endif // __COMMON_H__
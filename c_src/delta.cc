@@ -0,0 +1,445 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ */
+
+#include "delta.h"
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool writeDelta(const std::string &path, const std::string &base,
+    const Bounds &bounds)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+    std::string content(formatDelta(base, bounds));
+    fwrite(content.data(), 1, content.size(), f);
+    return fclose(f) == 0;
+}
+
+std::string formatDelta(const std::string &base, const Bounds &bounds)
+{
+    std::string result("base " + base + "\n");
+    char buf[96];
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        snprintf(buf, sizeof(buf), "b %d %.17g %.17g\n", bounds[i].var,
+            bounds[i].lb, bounds[i].ub);
+        result += buf;
+    }
+    return result;
+}
+
+bool readDelta(const std::string &path, std::string &base, Bounds &bounds)
+{
+    std::ifstream f(path.c_str());
+    if (!f)
+    {
+        fprintf(stderr, "Failed to open %s\n", path.c_str());
+        return false;
+    }
+
+    base.clear();
+    bounds.clear();
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream s(line);
+        std::string kind;
+        s >> kind;
+        if (kind == "base")
+        {
+            s >> base;
+        }
+        else if (kind == "b")
+        {
+            VarBound b;
+            std::string lb, ub;
+            s >> b.var >> lb >> ub;
+            if (!s)
+            {
+                fprintf(stderr, "Wrong bound in %s: %s\n", path.c_str(),
+                    line.c_str());
+                return false;
+            }
+            // istream doesn't parse infinities
+            b.lb = strtod(lb.c_str(), NULL);
+            b.ub = strtod(ub.c_str(), NULL);
+            bounds.push_back(b);
+        }
+    }
+    return true;
+}
+
+static bool isSegment(const std::string &line, char segment)
+{
+    return !line.empty() && line[0] == segment
+        && (line.size() == 1 || line[1] == ' ' || line[1] == '\t'
+            || line[1] == '#');
+}
+
+static bool parseBound(const std::string &line, double &lb, double &ub)
+{
+    std::istringstream s(line);
+    int type = -1;
+    s >> type;
+    lb = -DBL_MAX;
+    ub = DBL_MAX;
+    switch (type)
+    {
+    case 0:
+        s >> lb >> ub;
+        break;
+    case 1:
+        s >> ub;
+        break;
+    case 2:
+        s >> lb;
+        break;
+    case 3:
+        break;
+    case 4:
+        s >> lb;
+        ub = lb;
+        break;
+    default:
+        return false;
+    }
+    return !s.fail();
+}
+
+static std::string formatBound(double lb, double ub)
+{
+    char buf[64];
+    if (lb == ub)
+    {
+        sprintf(buf, "4 %.17g", lb);
+    }
+    else if (lb <= -DBL_MAX && ub >= DBL_MAX)
+    {
+        sprintf(buf, "3");
+    }
+    else if (lb <= -DBL_MAX)
+    {
+        sprintf(buf, "1 %.17g", ub);
+    }
+    else if (ub >= DBL_MAX)
+    {
+        sprintf(buf, "2 %.17g", lb);
+    }
+    else
+    {
+        sprintf(buf, "0 %.17g %.17g", lb, ub);
+    }
+    return buf;
+}
+
+bool writeNLWithBounds(const std::string &basePath, const Bounds &bounds,
+    const std::string &path)
+{
+    std::ifstream in(basePath.c_str());
+    if (!in)
+    {
+        fprintf(stderr, "Failed to open %s\n", basePath.c_str());
+        return false;
+    }
+    std::ofstream out(path.c_str());
+    if (!out)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+
+    std::map<int, const VarBound *> changed;
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        changed[bounds[i].var] = &(bounds[i]);
+    }
+
+    std::string line;
+    if (!std::getline(in, line) || line.empty() || line[0] != 'g')
+    {
+        fprintf(stderr, "%s is not a text NL file\n", basePath.c_str());
+        return false;
+    }
+    out << line << '\n';
+
+    // The second header line starts with the number of variables
+    int numVars = 0;
+    if (!std::getline(in, line) || !(std::istringstream(line) >> numVars))
+    {
+        fprintf(stderr, "Wrong NL header in %s\n", basePath.c_str());
+        return false;
+    }
+    out << line << '\n';
+
+    int var = -1;
+    while (std::getline(in, line))
+    {
+        if (var >= 0 && var < numVars)
+        {
+            std::map<int, const VarBound *>::iterator it = changed.find(var++);
+            double lb, ub;
+            if (it != changed.end() && parseBound(line, lb, ub))
+            {
+                lb = std::max(lb, it->second->lb);
+                ub = std::min(ub, it->second->ub);
+                line = formatBound(lb, ub);
+            }
+        }
+        else if (var < 0 && isSegment(line, 'b'))
+        {
+            var = 0;
+        }
+        out << line << '\n';
+    }
+
+    if (var < numVars)
+    {
+        fprintf(stderr, "No variable bounds found in %s\n", basePath.c_str());
+        return false;
+    }
+    out.close();
+    return !out.fail();
+}
+
+// Splits a header line into its numbers and the "# ..." comment
+static std::vector<long> parseHeader(const std::string &line,
+    std::string &comment)
+{
+    size_t hash = line.find('#');
+    comment = hash == std::string::npos ? "" : line.substr(hash);
+    std::istringstream s(line.substr(0, hash));
+    std::vector<long> numbers;
+    long n;
+    while (s >> n)
+    {
+        numbers.push_back(n);
+    }
+    return numbers;
+}
+
+static std::string formatHeader(const std::vector<long> &numbers,
+    const std::string &comment)
+{
+    std::ostringstream s;
+    for (size_t i = 0; i < numbers.size(); ++i)
+    {
+        s << ' ' << numbers[i];
+    }
+    if (!comment.empty())
+    {
+        s << '\t' << comment;
+    }
+    return s.str();
+}
+
+// The r lines of the rows, a range row is type 0 and an equality type 4
+static void writeBoundRows(std::ostream &out, const Bounds &bounds)
+{
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        out << formatBound(bounds[i].lb, bounds[i].ub) << '\n';
+    }
+}
+
+// The k line of column var, the number of nonzeros in the columns up to it
+static long addColumnCounts(long count, int var, const Bounds &bounds)
+{
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        if (bounds[i].var <= var)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+bool writeNLWithBoundRows(const std::string &basePath, const Bounds &bounds,
+    const std::string &path)
+{
+    std::ifstream in(basePath.c_str());
+    if (!in)
+    {
+        fprintf(stderr, "Failed to open %s\n", basePath.c_str());
+        return false;
+    }
+    std::ofstream out(path.c_str());
+    if (!out)
+    {
+        fprintf(stderr, "Failed to open %s for writing\n", path.c_str());
+        return false;
+    }
+
+    std::string line;
+    if (!std::getline(in, line) || line.empty() || line[0] != 'g')
+    {
+        fprintf(stderr, "%s is not a text NL file\n", basePath.c_str());
+        return false;
+    }
+    out << line << '\n';
+
+    // Vars, constraints, objectives, ranges, equalities; then nonzeros in
+    // the Jacobian and the gradients on the 8th line
+    std::string comment;
+    std::vector<long> sizes;
+    if (!std::getline(in, line)
+        || (sizes = parseHeader(line, comment)).size() < 5)
+    {
+        fprintf(stderr, "Wrong NL header in %s\n", basePath.c_str());
+        return false;
+    }
+    long numVars = sizes[0];
+    long numCons = sizes[1];
+    sizes[1] += bounds.size();
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        const VarBound &b = bounds[i];
+        if (b.lb == b.ub)
+        {
+            ++sizes[4];
+        }
+        else if (b.lb > -DBL_MAX && b.ub < DBL_MAX)
+        {
+            ++sizes[3];
+        }
+    }
+    out << formatHeader(sizes, comment) << '\n';
+    for (int i = 3; i <= 10; ++i)
+    {
+        if (!std::getline(in, line))
+        {
+            fprintf(stderr, "Wrong NL header in %s\n", basePath.c_str());
+            return false;
+        }
+        std::vector<long> nonzeros;
+        if (i == 8 && !(nonzeros = parseHeader(line, comment)).empty())
+        {
+            nonzeros[0] += bounds.size();
+            line = formatHeader(nonzeros, comment);
+        }
+        out << line << '\n';
+    }
+
+    // The r and k segments get the rows in place, the C and J segments of
+    // the rows go at the end. Without constraints the base may have neither.
+    bool hasRanges = false;
+    bool hasColumns = false;
+    char segment = 0;
+    long left = 0;
+    long column = 0;
+    while (std::getline(in, line))
+    {
+        if (left > 0)
+        {
+            if (segment == 'k')
+            {
+                long count = strtol(line.c_str(), NULL, 10);
+                std::ostringstream s;
+                s << addColumnCounts(count, column++, bounds);
+                line = s.str();
+            }
+            out << line << '\n';
+            if (--left == 0 && segment == 'r')
+            {
+                writeBoundRows(out, bounds);
+            }
+            continue;
+        }
+        segment = line.empty() ? 0 : line[0];
+        if (isSegment(line, 'r'))
+        {
+            hasRanges = true;
+            left = numCons;
+            out << line << '\n';
+            if (left == 0)
+            {
+                writeBoundRows(out, bounds);
+            }
+            continue;
+        }
+        if (!line.empty() && line[0] == 'k')
+        {
+            hasColumns = true;
+            left = strtol(line.c_str() + 1, NULL, 10);
+            column = 0;
+        }
+        out << line << '\n';
+    }
+    if (left > 0)
+    {
+        fprintf(stderr, "Truncated %c segment in %s\n", segment,
+            basePath.c_str());
+        return false;
+    }
+
+    if (!hasRanges)
+    {
+        out << "r\n";
+        writeBoundRows(out, bounds);
+    }
+    if (!hasColumns && numVars > 1)
+    {
+        out << 'k' << numVars - 1 << '\n';
+        for (long var = 0; var < numVars - 1; ++var)
+        {
+            out << addColumnCounts(0, var, bounds) << '\n';
+        }
+    }
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        long row = numCons + i;
+        out << 'C' << row << "\nn0\n";
+        out << 'J' << row << " 1\n" << bounds[i].var << " 1\n";
+    }
+    out.close();
+    return !out.fail();
+}
+
+int numVarsNL(const std::string &nlPath)
+{
+    // The header is text even in binary NL files
+    std::ifstream in(nlPath.c_str());
+    std::string line;
+    int numVars = -1;
+    if (!std::getline(in, line) || !std::getline(in, line)
+        || !(std::istringstream(line) >> numVars))
+    {
+        fprintf(stderr, "Wrong NL header in %s\n", nlPath.c_str());
+        return -1;
+    }
+    return numVars;
+}
+
+static std::string replaceExtension(const std::string &path,
+    const std::string &ext)
+{
+    size_t dot = path.find_last_of('.');
+    size_t delim = path.find_last_of("/\\");
+    if (dot == std::string::npos || (delim != std::string::npos && dot < delim))
+    {
+        return path + ext;
+    }
+    return path.substr(0, dot) + ext;
+}
+
+std::string deltaNameNL(const std::string &deltaPath)
+{
+    return replaceExtension(deltaPath, ".nl");
+}
+
+std::string solNameNL(const std::string &nlPath)
+{
+    return replaceExtension(nlPath, ".sol");
+}
@@ -0,0 +1,58 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Subproblem stored as bound changes applied to a shared base NL file.
+ *
+ * A delta file is text. It starts with a "base <file name>" line, followed
+ * by one "b <variable> <lower> <upper>" line per variable with changed
+ * bounds. The base file name is relative to the delta file's directory.
+ */
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <string>
+#include <vector>
+
+struct VarBound
+{
+    int var;
+    double lb;
+    double ub;
+};
+
+typedef std::vector<VarBound> Bounds;
+
+bool writeDelta(const std::string &path, const std::string &base,
+    const Bounds &bounds);
+
+/// Returns the content of the delta file writeDelta() writes
+std::string formatDelta(const std::string &base, const Bounds &bounds);
+
+bool readDelta(const std::string &path, std::string &base, Bounds &bounds);
+
+/**
+ * Writes a copy of the text (ASCII) NL file at basePath with the variable
+ * bounds intersected with the ones given.
+ */
+bool writeNLWithBounds(const std::string &basePath, const Bounds &bounds,
+    const std::string &path);
+
+/**
+ * Writes a copy of the text (ASCII) NL file at basePath with a linear
+ * constraint lb <= x[var] <= ub appended for each of the bounds given.
+ */
+bool writeNLWithBoundRows(const std::string &basePath, const Bounds &bounds,
+    const std::string &path);
+
+/// Returns the number of variables from the NL file header or -1
+int numVarsNL(const std::string &nlPath);
+
+/// Returns the path of the NL file a delta expands to: x.delta -> x.nl
+std::string deltaNameNL(const std::string &deltaPath);
+
+/// Returns the path of the AMPL solution file for an NL file: x.nl -> x.sol
+std::string solNameNL(const std::string &nlPath);
+
+#endif // __DELTA_H__
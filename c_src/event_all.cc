@@ -1,15 +1,285 @@
 #include "event_all.h"
 #include "ErlPortInterface.h"
+#include "PortStats.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+#include <math.h>
 
 #define EVENTHDLR_NAME         "all"
-#define EVENTHDLR_DESC         "event handler for all events"
+#define EVENTHDLR_DESC         "event handler exchanging incumbents with the port"
+
+/// Events needed: new incumbents and points to check for external ones
+#define EVENTHDLR_EVENTS       (SCIP_EVENTTYPE_BESTSOLFOUND | SCIP_EVENTTYPE_NODESOLVED | SCIP_EVENTTYPE_LPSOLVED)
+
+#define DEFAULT_NODEFREQ       1
+#define DEFAULT_TIMEFREQ       1.0
 
 extern ErlPortInterface g_portInterface;
 
+class SCIPBestValueAcceptor : public BestValueAcceptor
+{
+    SCIP *_scip;
+public:
+    SCIPBestValueAcceptor(SCIP *scip)
+        : _scip(scip)
+    {
+    }
+    void acceptNewBestValue(double bestVal)
+    {
+        SCIPsetObjlimit(_scip, bestVal);
+    }
+
+    /// Gives the heuristics a start if the solution fits the subproblem
+    void acceptNewBestSolution(double bestVal, const std::vector<double> &x)
+    {
+        SCIP_SOL *sol;
+        SCIP_Bool stored = FALSE;
+        int nvars = std::min((int)x.size(), SCIPgetNOrigVars(_scip));
+        if (SCIPcreateOrigSol(_scip, &sol, NULL) == SCIP_OKAY)
+        {
+            SCIPsetSolVals(_scip, sol, nvars, SCIPgetOrigVars(_scip),
+                (SCIP_Real *)&(x[0]));
+            // Checks bounds and constraints, solutions of other subproblems
+            // usually violate the split bounds
+#if SCIP_VERSION >= 400
+            SCIPtrySolFree(_scip, &sol, FALSE, FALSE, TRUE, TRUE, TRUE,
+                &stored);
+#else
+            // No completely argument before SCIP 4.0
+            SCIPtrySolFree(_scip, &sol, FALSE, TRUE, TRUE, TRUE, &stored);
+#endif
+        }
+        SCIPdebugMessage("received solution %s\n", stored ? "stored" : "rejected");
+        // Tried first, the limit only lets in solutions better than itself
+        SCIPsetObjlimit(_scip, bestVal);
+    }
+};
+
+/// Keeps the acceptor between events so it remembers what it has seen
+struct SCIP_EventhdlrData
+{
+    SCIP_EventhdlrData(SCIP *scip)
+        : acceptor(scip), nodefreq(DEFAULT_NODEFREQ),
+          timefreq(DEFAULT_TIMEFREQ), ncalls(0), nchecks(0),
+          nodesSinceCheck(0), lastCheckTime(0), checkpoint(NULL), slot(0)
+    {
+    }
+    SCIPBestValueAcceptor acceptor;
+
+    /// Check for external incumbents every nodefreq solved nodes
+    int nodefreq;
+    /// or after timefreq seconds at any node or LP event
+    SCIP_Real timefreq;
+
+    SCIP_Longint ncalls;
+    SCIP_Longint nchecks;
+    int nodesSinceCheck;
+    SCIP_Real lastCheckTime;
+
+    /// Subproblem for exported nodes
+    std::string base;
+    Bounds bounds;
+
+    CheckpointWriter *checkpoint;
+    size_t slot;
+    std::string nlfile;
+    std::string solFileName;
+};
+
+static bool isLowerBoundLess(SCIP_NODE *x, SCIP_NODE *y)
+{
+    return SCIPnodeGetLowerbound(x) < SCIPnodeGetLowerbound(y);
+}
+
+// Intersects the bounds of the original variable var with [lb, ub], SCIP
+// infinities become real ones for the delta
+static void tightenBounds(SCIP *scip, SCIP_VAR *var, int index, double lb,
+    double ub, Bounds &bounds)
+{
+    size_t i = 0;
+    while (i < bounds.size() && bounds[i].var != index)
+    {
+        ++i;
+    }
+    if (i == bounds.size())
+    {
+        VarBound b = {index, SCIPvarGetLbOriginal(var), SCIPvarGetUbOriginal(var)};
+        bounds.push_back(b);
+    }
+    bounds[i].lb = std::max(bounds[i].lb, lb);
+    bounds[i].ub = std::min(bounds[i].ub, ub);
+    if (SCIPisInfinity(scip, -bounds[i].lb))
+    {
+        bounds[i].lb = -HUGE_VAL;
+    }
+    if (SCIPisInfinity(scip, bounds[i].ub))
+    {
+        bounds[i].ub = HUGE_VAL;
+    }
+}
+
+/**
+ * Adds the branchings from the root to node, mapped back to the original
+ * variables. Branchings on variables presolving replaced by expressions of
+ * several original ones are left out, that only makes the exported
+ * subproblem larger than the node.
+ */
+static SCIP_RETCODE addNodeBounds(SCIP *scip, SCIP_NODE *node, Bounds &bounds)
+{
+    int nbranchings = 0;
+    SCIPnodeGetAncestorBranchings(node, NULL, NULL, NULL, &nbranchings, 0);
+    if (nbranchings == 0)
+    {
+        return SCIP_OKAY;
+    }
+    std::vector<SCIP_VAR *> vars(nbranchings);
+    std::vector<SCIP_Real> values(nbranchings);
+    std::vector<SCIP_BOUNDTYPE> types(nbranchings);
+    SCIPnodeGetAncestorBranchings(node, &(vars[0]), &(values[0]), &(types[0]),
+        &nbranchings, nbranchings);
+
+    for (int i = 0; i < nbranchings; ++i)
+    {
+        // var = scalar * orig + constant
+        SCIP_VAR *var = vars[i];
+        SCIP_Real scalar = 1.;
+        SCIP_Real constant = 0.;
+        SCIP_CALL( SCIPvarGetOrigvarSum(&var, &scalar, &constant) );
+        if (var == NULL || scalar == 0. || SCIPvarGetProbindex(var) < 0)
+        {
+            continue;
+        }
+        double value = (values[i] - constant) / scalar;
+        bool isLower = (types[i] == SCIP_BOUNDTYPE_LOWER) == (scalar > 0.);
+        if (SCIPvarIsIntegral(var))
+        {
+            value = isLower ? SCIPfeasCeil(scip, value) : SCIPfeasFloor(scip, value);
+        }
+        tightenBounds(scip, var, SCIPvarGetProbindex(var),
+            isLower ? value : -SCIPinfinity(scip),
+            isLower ? SCIPinfinity(scip) : value, bounds);
+    }
+    return SCIP_OKAY;
+}
+
+/**
+ * Gives up at most half of the open nodes, the leaves with the lowest
+ * bounds since they are likely to have the largest subtrees. They are cut
+ * off here and returned as deltas.
+ */
+static SCIP_RETCODE exportNodes(SCIP *scip, SCIP_EVENTHDLRDATA *data,
+    int numNodes, std::vector<std::string> &deltas)
+{
+    SCIP_NODE **leaves;
+    SCIP_NODE **children;
+    SCIP_NODE **siblings;
+    int nleaves, nchildren, nsiblings;
+    SCIP_CALL( SCIPgetOpenNodesData(scip, &leaves, &children, &siblings,
+            &nleaves, &nchildren, &nsiblings) );
+
+    std::vector<SCIP_NODE *> nodes(leaves, leaves + nleaves);
+    std::sort(nodes.begin(), nodes.end(), isLowerBoundLess);
+    numNodes = std::min(numNodes, (nleaves + nchildren + nsiblings) / 2);
+    numNodes = std::min(numNodes, nleaves);
+
+    for (int i = 0; i < numNodes; ++i)
+    {
+        Bounds bounds(data->bounds);
+        SCIP_CALL( addNodeBounds(scip, nodes[i], bounds) );
+        deltas.push_back(formatDelta(data->base, bounds));
+    }
+    for (int i = 0; i < numNodes; ++i)
+    {
+        SCIP_CALL( SCIPcutoffNode(scip, nodes[i]) );
+    }
+    SCIPinfoMessage(scip, NULL, "Exported %d of %d open nodes\n", numNodes,
+        nleaves + nchildren + nsiblings);
+    return SCIP_OKAY;
+}
+
+/**
+ * Replaces the deepest nodes by their parents until at most maxNodes are
+ * left. A parent covers the subtrees of its children, so the nodes still
+ * cover all open ones, at the cost of solving some of the tree again.
+ */
+static void coarsenNodes(std::vector<SCIP_NODE *> &nodes, size_t maxNodes)
+{
+    std::sort(nodes.begin(), nodes.end());
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    while (nodes.size() > maxNodes)
+    {
+        int depth = 0;
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            depth = std::max(depth, SCIPnodeGetDepth(nodes[i]));
+        }
+        if (depth == 0)
+        {
+            break;
+        }
+        // No node is an ancestor of another, so the parents of the
+        // deepest ones are not ancestors of any node either
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            if (SCIPnodeGetDepth(nodes[i]) == depth)
+            {
+                nodes[i] = SCIPnodeGetParent(nodes[i]);
+            }
+        }
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    }
+}
+
+/**
+ * Stores the open nodes, merged into a few ancestors, and the incumbent in
+ * the checkpoint and has it written. Only the bounds are collected here,
+ * the writer formats the file in its own thread.
+ */
+static SCIP_RETCODE saveCheckpoint(SCIP *scip, SCIP_EVENTHDLRDATA *data)
+{
+    SCIP_NODE **lists[3];
+    int sizes[3];
+    SCIP_CALL( SCIPgetOpenNodesData(scip, &lists[0], &lists[1], &lists[2],
+            &sizes[0], &sizes[1], &sizes[2]) );
+
+    std::vector<SCIP_NODE *> open;
+    for (int i = 0; i < 3; ++i)
+    {
+        open.insert(open.end(), lists[i], lists[i] + sizes[i]);
+    }
+    size_t numOpen = open.size();
+    coarsenNodes(open, CHECKPOINT_NODES_PER_SOLVER);
+
+    CheckpointNodes nodes(open.size());
+    for (size_t i = 0; i < open.size(); ++i)
+    {
+        nodes[i].nlfile = data->nlfile;
+        nodes[i].solFileName = data->solFileName;
+        nodes[i].bounds = data->bounds;
+        SCIP_CALL( addNodeBounds(scip, open[i], nodes[i].bounds) );
+    }
+    data->checkpoint->setNodes(data->slot, nodes);
+    SCIP_SOL *sol = SCIPgetBestSol(scip);
+    if (sol != NULL)
+    {
+        std::vector<double> x(SCIPgetNOrigVars(scip));
+        SCIP_CALL( SCIPgetSolVals(scip, sol, x.size(), SCIPgetOrigVars(scip),
+                x.empty() ? NULL : &(x[0])) );
+        data->checkpoint->setIncumbent(SCIPgetSolOrigObj(scip, sol),
+            data->nlfile, data->solFileName, x);
+    }
+    data->checkpoint->requestWrite();
+    SCIPinfoMessage(scip, NULL, "Checkpoint of %lu open nodes in %lu\n",
+        numOpen, nodes.size());
+    return SCIP_OKAY;
+}
+
 static
 SCIP_DECL_EVENTCOPY(eventCopyAll)
 {
@@ -20,6 +290,19 @@ SCIP_DECL_EVENTCOPY(eventCopyAll)
     return SCIP_OKAY;
 }
 
+static
+SCIP_DECL_EVENTFREE(eventFreeAll)
+{
+    assert(scip != NULL);
+    assert(eventhdlr != NULL);
+    assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
+
+    delete SCIPeventhdlrGetData(eventhdlr);
+    SCIPeventhdlrSetData(eventhdlr, NULL);
+
+    return SCIP_OKAY;
+}
+
 static
 SCIP_DECL_EVENTINIT(eventInitAll)
 {
@@ -27,7 +310,13 @@ SCIP_DECL_EVENTINIT(eventInitAll)
     assert(eventhdlr != NULL);
     assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
     
-    SCIP_CALL( SCIPcatchEvent( scip, 0xFFFFFFFF, eventhdlr, NULL, NULL) );
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    data->ncalls = 0;
+    data->nchecks = 0;
+    data->nodesSinceCheck = 0;
+    data->lastCheckTime = SCIPgetSolvingTime(scip);
+
+    SCIP_CALL( SCIPcatchEvent( scip, EVENTHDLR_EVENTS, eventhdlr, NULL, NULL) );
     
     return SCIP_OKAY;
 }
@@ -39,24 +328,20 @@ SCIP_DECL_EVENTEXIT(eventExitAll)
     assert(eventhdlr != NULL);
     assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
     
-    SCIP_CALL( SCIPdropEvent( scip, 0xFFFFFFFF, eventhdlr, NULL, -1) );
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    SCIPinfoMessage(scip, NULL, "Event handler %s: %lld callbacks, %lld checks for external incumbents\n",
+        EVENTHDLR_NAME, data->ncalls, data->nchecks);
+
+    SCIP_CALL( SCIPdropEvent( scip, EVENTHDLR_EVENTS, eventhdlr, NULL, -1) );
     
     return SCIP_OKAY;
 }
 
-class SCIPBestValueAcceptor : public BestValueAcceptor
+static void reportProgress(SCIP *scip, SCIP_EVENTHDLRDATA *data)
 {
-    SCIP *_scip;
-public:
-    SCIPBestValueAcceptor(SCIP *scip)
-        : _scip(scip)
-    {
-    }
-    void acceptNewBestValue(double bestVal)
-    {
-        SCIPsetObjlimit(_scip, bestVal);
-    }
-};
+    g_portInterface.reportProgress(data->acceptor, SCIPgetDualbound(scip),
+        SCIPgetNNodes(scip), SCIPgetNNodesLeft(scip));
+}
 
 static
 SCIP_DECL_EVENTEXEC(eventExecAll)
@@ -66,34 +351,130 @@ SCIP_DECL_EVENTEXEC(eventExecAll)
     assert(event != NULL);
     assert(scip != NULL);
 
-    SCIP_STAGE stage = SCIPgetStage(scip);
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    ++data->ncalls;
+    countPortEvent(STAT_SOLVER_EVENTS);
+    PortTimerScope timer(TIMER_SOLVER_EVENT);
 
     if (SCIPeventGetType(event) ==  SCIP_EVENTTYPE_BESTSOLFOUND) {
         SCIPdebugMessage("exec method of event handler for best solution found\n");
-        g_portInterface.setBestValue(SCIPgetSolOrigObj(scip, SCIPeventGetSol(event)), true);
-    } else if (stage == SCIP_STAGE_PROBLEM || stage == SCIP_STAGE_TRANSFORMED ||
-        stage == SCIP_STAGE_INITPRESOLVE || stage == SCIP_STAGE_PRESOLVING ||
-        stage == SCIP_STAGE_EXITPRESOLVE || stage == SCIP_STAGE_PRESOLVED ||
-        stage == SCIP_STAGE_SOLVING)
+        SCIP_SOL *sol = SCIPeventGetSol(event);
+        // The NL reader creates the stub's variables first and in order
+        int nvars = SCIPgetNOrigVars(scip);
+        std::vector<double> x(nvars);
+        SCIP_CALL( SCIPgetSolVals(scip, sol, nvars, SCIPgetOrigVars(scip), nvars ? &(x[0]) : NULL) );
+        g_portInterface.setBestSolution(SCIPgetSolOrigObj(scip, sol), nvars ? &(x[0]) : NULL, nvars,
+            &data->acceptor);
+        return SCIP_OKAY;
+    }
+
+    // Ends as after a limit, so the result and the solution are written
+    if (g_portInterface.isCancelled() && SCIPgetStage(scip) == SCIP_STAGE_SOLVING)
     {
-        SCIPBestValueAcceptor acceptor(scip);
-        g_portInterface.getBestValue(acceptor);
+        SCIP_CALL( SCIPinterruptSolve(scip) );
+        return SCIP_OKAY;
+    }
+
+    bool check = false;
+    if (SCIPeventGetType(event) & SCIP_EVENTTYPE_NODESOLVED)
+    {
+        int numNodes = g_portInterface.takeExportRequest();
+        if (numNodes > 0)
+        {
+            std::vector<std::string> deltas;
+            SCIP_RETCODE retcode = exportNodes(scip, data, numNodes, deltas);
+            // Always answers, so Erlang doesn't wait for nodes forever
+            g_portInterface.sendExportedNodes(deltas);
+            SCIP_CALL( retcode );
+        }
+        if (data->checkpoint != NULL && data->checkpoint->isDue())
+        {
+            SCIP_CALL( saveCheckpoint(scip, data) );
+        }
+
+        check = data->nodefreq > 0 && ++data->nodesSinceCheck >= data->nodefreq;
+    }
+    SCIP_Real time = SCIPgetSolvingTime(scip);
+    if (data->timefreq > 0 && time - data->lastCheckTime >= data->timefreq)
+    {
+        check = true;
+    }
+
+    if (check)
+    {
+        ++data->nchecks;
+        data->nodesSinceCheck = 0;
+        data->lastCheckTime = time;
+        g_portInterface.getBestValue(data->acceptor);
+        reportProgress(scip, data);
     }
     
     return SCIP_OKAY;
 }
 
+SCIP_RETCODE SCIPreportEventHdlrAllProgress(SCIP *scip)
+{
+    SCIP_EVENTHDLR *eventhdlr = SCIPfindEventhdlr(scip, EVENTHDLR_NAME);
+    if (eventhdlr == NULL)
+    {
+        return SCIP_PLUGINNOTFOUND;
+    }
+    reportProgress(scip, SCIPeventhdlrGetData(eventhdlr));
+    return SCIP_OKAY;
+}
+
+SCIP_RETCODE SCIPsetEventHdlrAllSubproblem(SCIP *scip, const std::string &base,
+    const Bounds &bounds)
+{
+    SCIP_EVENTHDLR *eventhdlr = SCIPfindEventhdlr(scip, EVENTHDLR_NAME);
+    if (eventhdlr == NULL)
+    {
+        return SCIP_PLUGINNOTFOUND;
+    }
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    data->base = base;
+    data->bounds = bounds;
+    data->acceptor.resetSeen();
+    return SCIP_OKAY;
+}
+
+SCIP_RETCODE SCIPsetEventHdlrAllCheckpoint(SCIP *scip,
+    CheckpointWriter *checkpoint, size_t slot, const std::string &nlfile,
+    const std::string &solFileName)
+{
+    SCIP_EVENTHDLR *eventhdlr = SCIPfindEventhdlr(scip, EVENTHDLR_NAME);
+    if (eventhdlr == NULL)
+    {
+        return SCIP_PLUGINNOTFOUND;
+    }
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    data->checkpoint = checkpoint;
+    data->slot = slot;
+    data->nlfile = nlfile;
+    data->solFileName = solFileName;
+    return SCIP_OKAY;
+}
+
 SCIP_RETCODE SCIPincludeEventHdlrAll(SCIP *scip)
 {
     SCIP_EVENTHDLR* eventhdlr = NULL;
+    SCIP_EVENTHDLRDATA *data = new SCIP_EVENTHDLRDATA(scip);
 
     SCIP_CALL( SCIPincludeEventhdlrBasic(scip, &eventhdlr, EVENTHDLR_NAME, EVENTHDLR_DESC,
-            eventExecAll, NULL) );
+            eventExecAll, data) );
     assert(eventhdlr != NULL);
 
     SCIP_CALL( SCIPsetEventhdlrCopy(scip, eventhdlr, eventCopyAll) );
+    SCIP_CALL( SCIPsetEventhdlrFree(scip, eventhdlr, eventFreeAll) );
     SCIP_CALL( SCIPsetEventhdlrInit(scip, eventhdlr, eventInitAll) );
     SCIP_CALL( SCIPsetEventhdlrExit(scip, eventhdlr, eventExitAll) );
 
+    SCIP_CALL( SCIPaddIntParam(scip, "eventhdlr/" EVENTHDLR_NAME "/nodefreq",
+            "check for external incumbents every that many solved nodes (0: never)",
+            &data->nodefreq, FALSE, DEFAULT_NODEFREQ, 0, INT_MAX, NULL, NULL) );
+    SCIP_CALL( SCIPaddRealParam(scip, "eventhdlr/" EVENTHDLR_NAME "/timefreq",
+            "check for external incumbents at node or LP events after that many seconds (0: never)",
+            &data->timefreq, FALSE, DEFAULT_TIMEFREQ, 0.0, SCIP_REAL_MAX, NULL, NULL) );
+
     return SCIP_OKAY;
 }
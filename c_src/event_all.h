@@ -2,8 +2,33 @@
 #define __SCIP_EVENT_ALL_H__
 
 #include "scip/scip.h"
+#include "delta.h"
+#include "checkpoint.h"
 
 SCIP_RETCODE SCIPincludeEventHdlrAll(SCIP *scip);
 
+/**
+ * Sends the dual bound and node counts of the search, also done at every
+ * check for external incumbents. Called once more after SCIPsolve() so the
+ * finished solver counts no open nodes.
+ */
+SCIP_RETCODE SCIPreportEventHdlrAllProgress(SCIP *scip);
+
+/**
+ * Tells the handler the subproblem being solved, open nodes given up are
+ * exported as deltas of the same base with these bounds tightened. The best
+ * value known is passed to the solver again.
+ */
+SCIP_RETCODE SCIPsetEventHdlrAllSubproblem(SCIP *scip, const std::string &base,
+    const Bounds &bounds);
+
+/**
+ * Makes the handler store the open nodes of the solve in the slot of the
+ * checkpoint whenever it is due. Nodes refer to nlfile and solFileName.
+ */
+SCIP_RETCODE SCIPsetEventHdlrAllCheckpoint(SCIP *scip,
+    CheckpointWriter *checkpoint, size_t slot, const std::string &nlfile,
+    const std::string &solFileName);
+
 
 #endif
@@ -0,0 +1,239 @@
+#include "event_estimate.h"
+
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#define EVENTHDLR_NAME         "estimate"
+#define EVENTHDLR_DESC         "event handler estimating the tree size"
+
+/// Nodes solved without children: integral, infeasible or cut off
+#define EVENTHDLR_EVENTS       (SCIP_EVENTTYPE_NODEFEASIBLE | SCIP_EVENTTYPE_NODEINFEASIBLE)
+
+/// Fewer leaves than that give no estimate
+#define MIN_LEAVES             10
+/// Subproblems per core, so the ones that finish early leave no core idle
+#define LEAVES_PER_CORE        4
+/// A subproblem expected below that many nodes isn't worth its presolve
+#define MIN_NODES_PER_LEAF     100
+
+struct SCIP_EventhdlrData
+{
+    SCIP_EventhdlrData()
+        : nleaves(0), weights(0)
+    {
+    }
+    SCIP_Longint nleaves;
+    /// Sum of 2^-depth over the leaves
+    SCIP_Real weights;
+};
+
+struct SplitEstimate
+{
+    int var;
+    double down;
+    double up;
+    double score;
+    double downNodes;
+    double upNodes;
+
+    bool operator<(const SplitEstimate &other) const
+    {
+        return score > other.score;
+    }
+};
+
+static
+SCIP_DECL_EVENTFREE(eventFreeEstimate)
+{
+    assert(scip != NULL);
+    assert(eventhdlr != NULL);
+    assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
+
+    delete SCIPeventhdlrGetData(eventhdlr);
+    SCIPeventhdlrSetData(eventhdlr, NULL);
+
+    return SCIP_OKAY;
+}
+
+static
+SCIP_DECL_EVENTINIT(eventInitEstimate)
+{
+    assert(scip != NULL);
+    assert(eventhdlr != NULL);
+    assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
+
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    data->nleaves = 0;
+    data->weights = 0;
+
+    SCIP_CALL( SCIPcatchEvent( scip, EVENTHDLR_EVENTS, eventhdlr, NULL, NULL) );
+
+    return SCIP_OKAY;
+}
+
+static
+SCIP_DECL_EVENTEXIT(eventExitEstimate)
+{
+    assert(scip != NULL);
+    assert(eventhdlr != NULL);
+    assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
+
+    SCIP_CALL( SCIPdropEvent( scip, EVENTHDLR_EVENTS, eventhdlr, NULL, -1) );
+
+    return SCIP_OKAY;
+}
+
+static
+SCIP_DECL_EVENTEXEC(eventExecEstimate)
+{
+    assert(eventhdlr != NULL);
+    assert(strcmp(SCIPeventhdlrGetName(eventhdlr), EVENTHDLR_NAME) == 0);
+    assert(event != NULL);
+    assert(scip != NULL);
+
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    int depth = SCIPnodeGetDepth(SCIPeventGetNode(event));
+    ++data->nleaves;
+    data->weights += ldexp(1.0, -depth);
+
+    return SCIP_OKAY;
+}
+
+/**
+ * Nodes of the whole tree: all of them if the search is complete, the
+ * weighted backtrack estimate with enough leaves, else -1. The leaves
+ * stand for trees of sum(2 - 2^-d) / sum(2^-d) nodes on the average.
+ */
+static double estimateTreeSize(SCIP *scip, const SCIP_EVENTHDLRDATA *data)
+{
+    SCIP_Longint nnodes = SCIPgetNNodes(scip);
+    if (SCIPgetStatus(scip) == SCIP_STATUS_OPTIMAL
+        || SCIPgetStatus(scip) == SCIP_STATUS_INFEASIBLE)
+    {
+        return nnodes;
+    }
+    if (data->nleaves < MIN_LEAVES || data->weights <= 0)
+    {
+        return -1;
+    }
+    double wbe = (2. * data->nleaves - data->weights) / data->weights;
+    // The open nodes are still to be solved
+    return std::max(wbe, (double)(nnodes + SCIPgetNNodesLeft(scip)));
+}
+
+/**
+ * Estimates the subtrees of splitting the original variable into the
+ * halves nlmod's halfs makes. The gains are pseudocosts from the root LP
+ * value to the nearest point of each half. A tree of treeSize nodes closes
+ * a gap of gap, so a child starting gain closer is taken to need
+ * treeSize^(1 - gain / gap) nodes. Returns false if the variable has no
+ * pseudocosts or an infinite domain.
+ */
+static bool estimateSplit(SCIP *scip, int index, SCIP_VAR *origVar,
+    double treeSize, double gap, SplitEstimate &split)
+{
+    SCIP_VAR *var;
+    if (SCIPvarGetType(origVar) == SCIP_VARTYPE_CONTINUOUS
+        || SCIPgetTransformedVar(scip, origVar, &var) != SCIP_OKAY
+        || var == NULL || !SCIPvarIsActive(var)
+        || SCIPgetVarPseudocostCount(scip, var, SCIP_BRANCHDIR_DOWNWARDS)
+        + SCIPgetVarPseudocostCount(scip, var, SCIP_BRANCHDIR_UPWARDS) <= 0)
+    {
+        return false;
+    }
+    double lb = SCIPvarGetLbOriginal(origVar);
+    double ub = SCIPvarGetUbOriginal(origVar);
+    if (SCIPisInfinity(scip, -lb) || SCIPisInfinity(scip, ub) || ub - lb < 1)
+    {
+        return false;
+    }
+    double left = floor(lb + (ub - lb) / 2.);
+    double right = floor(lb + (ub - lb) / 2. + 1.);
+    double x = SCIPvarGetRootSol(var);
+
+    split.var = index;
+    split.down = x > left ? SCIPgetVarPseudocostVal(scip, var, left - x) : 0;
+    split.up = x < right ? SCIPgetVarPseudocostVal(scip, var, right - x) : 0;
+    split.score = SCIPgetBranchScore(scip, var, split.down, split.up);
+    split.downNodes = split.upNodes = -1;
+    if (treeSize > 0 && gap > 0)
+    {
+        split.downNodes = pow(treeSize, 1. - std::min(split.down / gap, 1.));
+        split.upNodes = pow(treeSize, 1. - std::min(split.up / gap, 1.));
+    }
+    return true;
+}
+
+SCIP_RETCODE SCIPprintEventHdlrEstimate(SCIP *scip, int numCores, FILE *file)
+{
+    SCIP_EVENTHDLR *eventhdlr = SCIPfindEventhdlr(scip, EVENTHDLR_NAME);
+    if (eventhdlr == NULL)
+    {
+        return SCIP_PLUGINNOTFOUND;
+    }
+    SCIP_EVENTHDLRDATA *data = SCIPeventhdlrGetData(eventhdlr);
+    double treeSize = estimateTreeSize(scip, data);
+    fprintf(file, "Nodes: %lld\nOpen nodes: %d\nLeaves: %lld\nTime: %.2f\nTree size estimate: %.0f\n",
+        SCIPgetNNodes(scip), SCIPgetNNodesLeft(scip), data->nleaves,
+        SCIPgetSolvingTime(scip), treeSize);
+
+    // The gap the whole tree closes from the root, in the transformed sense
+    double gap = -1;
+    if (SCIPgetNSols(scip) > 0)
+    {
+        gap = SCIPgetTransObjval(scip, SCIPgetBestSol(scip)) - SCIPgetLowerboundRoot(scip);
+    }
+
+    std::vector<SplitEstimate> splits;
+    int nvars = SCIPgetNOrigVars(scip);
+    SCIP_VAR **vars = SCIPgetOrigVars(scip);
+    for (int i = 0; i < nvars; ++i)
+    {
+        SplitEstimate split;
+        if (estimateSplit(scip, i, vars[i], treeSize, gap, split))
+        {
+            splits.push_back(split);
+        }
+    }
+    std::sort(splits.begin(), splits.end());
+    fprintf(file, "VarN\tDown\tUp\tScore\tDownNodes\tUpNodes\n");
+    for (size_t i = 0; i < splits.size(); ++i)
+    {
+        fprintf(file, "%d\t%g\t%g\t%g\t%.0f\t%.0f\n", splits[i].var, splits[i].down,
+            splits[i].up, splits[i].score, splits[i].downNodes, splits[i].upNodes);
+    }
+
+    // Leaves for every core to have a few, no more than the tree has room for
+    double numLeaves = (double)numCores * LEAVES_PER_CORE;
+    if (treeSize >= 0)
+    {
+        numLeaves = std::min(numLeaves, treeSize / MIN_NODES_PER_LEAF);
+    }
+    int depth = numLeaves >= 2 ? (int)ceil(log(numLeaves) / log(2.) - 1e-9) : 0;
+    depth = std::min(depth, (int)splits.size());
+    fprintf(file, "Depth: %d\nSplits:", depth);
+    for (int i = 0; i < depth; ++i)
+    {
+        fprintf(file, " halfs %d", splits[i].var);
+    }
+    fprintf(file, "\n");
+    return SCIP_OKAY;
+}
+
+SCIP_RETCODE SCIPincludeEventHdlrEstimate(SCIP *scip)
+{
+    SCIP_EVENTHDLR* eventhdlr = NULL;
+    SCIP_EVENTHDLRDATA *data = new SCIP_EVENTHDLRDATA();
+
+    SCIP_CALL( SCIPincludeEventhdlrBasic(scip, &eventhdlr, EVENTHDLR_NAME, EVENTHDLR_DESC,
+            eventExecEstimate, data) );
+    assert(eventhdlr != NULL);
+
+    SCIP_CALL( SCIPsetEventhdlrFree(scip, eventhdlr, eventFreeEstimate) );
+    SCIP_CALL( SCIPsetEventhdlrInit(scip, eventhdlr, eventInitEstimate) );
+    SCIP_CALL( SCIPsetEventhdlrExit(scip, eventhdlr, eventExitEstimate) );
+
+    return SCIP_OKAY;
+}
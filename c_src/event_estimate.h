@@ -0,0 +1,21 @@
+#ifndef __SCIP_EVENT_ESTIMATE_H__
+#define __SCIP_EVENT_ESTIMATE_H__
+
+#include "scip/scip.h"
+
+/**
+ * Counts the leaves of the search by depth for the weighted backtrack
+ * estimate of the tree size, a leaf at depth d standing for a tree of
+ * 2^(d+1) - 1 nodes with weight 2^-d.
+ */
+SCIP_RETCODE SCIPincludeEventHdlrEstimate(SCIP *scip);
+
+/**
+ * Prints the tree size estimate of the search so far and the estimated
+ * subtrees of halfs splits of the integer variables with pseudocosts, then
+ * the depth and the nlmod splits recommended to keep numCores busy with
+ * subproblems worth their own root processing. Called after SCIPsolve().
+ */
+SCIP_RETCODE SCIPprintEventHdlrEstimate(SCIP *scip, int numCores, FILE *file);
+
+#endif
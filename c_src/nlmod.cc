@@ -4,21 +4,140 @@
  */
 
 #include "common.h"
+#include "ModelImage.h"
+#ifdef HAVE_CLP
+#include "LPRelaxation.h"
+#endif
 
 #include "asl/aslproblem.h"
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+// Replaces "auto <leaves>" with the halfs splits chosen on the LP relaxation
+static bool selectAuto(const mp::ASLProblem &p, int &argc, char **&argv,
+    std::vector<std::string> &args, std::vector<char *> &argPtrs)
+{
+    if (argc != 2)
+    {
+        std::cout << "auto can't be combined with other splits" << std::endl;
+        return false;
+    }
+#ifdef HAVE_CLP
+    std::vector<SplitCandidate> chosen(selectSplitVariables(p, atoi(argv[1])));
+    std::cout << "VarN\tDown\tUp\tScore" << std::endl;
+    for (size_t i = 0; i < chosen.size(); ++i)
+    {
+        std::cout << chosen[i].var << "\t" << chosen[i].down << "\t"
+                  << chosen[i].up << "\t" << chosen[i].score << std::endl;
+        char buf[32];
+        sprintf(buf, "%d", chosen[i].var);
+        args.push_back("halfs");
+        args.push_back(buf);
+    }
+
+    std::cout << "Splits:";
+    for (size_t i = 0; i < args.size(); ++i)
+    {
+        std::cout << " " << args[i];
+        argPtrs.push_back(const_cast<char *>(args[i].c_str()));
+    }
+    std::cout << std::endl;
+
+    argc = argPtrs.size();
+    argv = argPtrs.empty() ? NULL : &(argPtrs[0]);
+    return true;
+#else
+    std::cout << "auto needs nlmod built with Clp" << std::endl;
+    return false;
+#endif
+}
 
 int main(int argc, char **argv)
 {
-    if (argc != 2 && argc % 2 != 0)
+    const char *progName = argv[0];
+    int numThreads = 1;
+    SubproblemFormat format = FORMAT_NL;
+    bool leafBounds = false;
+    bool prune = false;
+    bool hasIncumbent = false;
+    double incumbent = 0;
+    bool image = false;
+    bool wrongArgs = false;
+    while (!wrongArgs && argc > 1 && argv[1][0] == '-')
     {
-        std::cout << "Usage: " << argv[0]
-                  << " <stub>.nl [<split | halfs> <variable number>]*" << std::endl;
+        if (!strcmp(argv[1], "-d"))
+        {
+            format = FORMAT_DELTA;
+        }
+        else if (!strcmp(argv[1], "-B"))
+        {
+            format = FORMAT_NL_BOUNDS;
+        }
+        else if (!strcmp(argv[1], "-L"))
+        {
+            leafBounds = true;
+        }
+        else if (!strcmp(argv[1], "-P"))
+        {
+            prune = true;
+        }
+        else if (!strcmp(argv[1], "-I"))
+        {
+            image = true;
+        }
+        else if (!strcmp(argv[1], "-b") && argc > 2)
+        {
+            prune = true;
+            hasIncumbent = true;
+            incumbent = atof(argv[2]);
+            --argc;
+            ++argv;
+        }
+        else if (!strcmp(argv[1], "-j") && argc > 2)
+        {
+            numThreads = atoi(argv[2]);
+            --argc;
+            ++argv;
+        }
+        else
+        {
+            wrongArgs = true;
+        }
+        --argc;
+        ++argv;
+    }
+
+    if (wrongArgs || argc < 2 || (argc != 2 && argc % 2 != 0) || numThreads < 1
+        || (image && argc != 2))
+    {
+        std::cout << "Usage: " << progName
+                  << " [-d | -B] [-L] [-P] [-b <incumbent>] [-j <threads>] <stub>.nl [<split | halfs> <variable number>]*"
+                  << std::endl
+                  << "       " << progName
+                  << " [-d | -B] [-L] [-P] [-b <incumbent>] [-j <threads>] <stub>.nl auto <number of subproblems>"
+                  << std::endl
+                  << "       " << progName
+                  << " -I <stub>.nl"
+                  << std::endl;
         return 1;
     }
 
     mp::ASLProblem p;
     p.Read(argv[1]);
+
+    // <stub>.img next to the stub, for the ports to map
+    if (image)
+    {
+        std::string path(imageNameNL(argv[1]));
+        if (!writeImage(p, argv[1], path))
+        {
+            return 1;
+        }
+        std::cout << "Written " << path << std::endl;
+        return 0;
+    }
     
     if (argc == 2)
     {
@@ -36,20 +155,29 @@ int main(int argc, char **argv)
     argc -= 2;
     argv += 2;
 
-    VecChanges previous(1, mp::ProblemChanges(p));
-    while (argc >= 2)
+    std::vector<std::string> autoArgs;
+    std::vector<char *> autoArgPtrs;
+    if (!strcmp(argv[0], "auto") && !selectAuto(p, argc, argv, autoArgs, autoArgPtrs))
+    {
+        return 1;
+    }
+
+    for (int i = 0; i < argc; i += 2)
     {
-        VecChanges updated;
-        for (int i = 0; i < previous.size(); ++i)
+        if (parseSplitVariable(p, argc - i, argv + i) < 0)
         {
-            VecChanges tmp(splitVariableArgv(p, previous[i], argc, argv));
-            updated.insert(updated.end(), tmp.begin(), tmp.end());
+            return 1;
         }
-        previous = updated;
-        argc -= 2;
-        argv += 2;
     }
-    writeChanged(baseName, p, previous);
+
+    SubproblemWriter writer(baseName, p, numThreads, format);
+    writer.setLeafBounds(leafBounds);
+    if (prune)
+    {
+        writer.setPruning(hasIncumbent, incumbent);
+    }
+    writeSplit(p, Bounds(), argc, argv, writer);
+    writer.finish();
 
     return 0;
 }
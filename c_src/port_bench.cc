@@ -0,0 +1,357 @@
+/**
+ * @file
+ * @author Sergey Smirnov <sasmir@gmail.com>
+ *
+ * Measures how long an incumbent takes from one solver to another through
+ * the port layer: setBestValue(), the publisher thread, a relay standing
+ * for Erlang, readerLoop() and the getBestValue() poll of the other solver.
+ *
+ * Two fake solver processes talk to this process by pipes on fds 3 and 4
+ * like ports do. The producer finds values -1, -2, ..., -N, the relay
+ * forwards every incumbent to the consumer as a best value from Erlang.
+ * Both record CLOCK_MONOTONIC times in shared memory.
+ */
+
+#include "ErlPortInterface.h"
+
+#include <vector>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+ErlPortInterface g_portInterface;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Shared
+{
+    /// Time the producer found value -k, 0 if not yet
+    double *found;
+    /// Time the consumer's acceptor got value -k, 0 if never
+    double *accepted;
+    int numValues;
+};
+
+static Shared s_shared;
+
+class TimingAcceptor : public BestValueAcceptor
+{
+ public:
+    TimingAcceptor()
+        : _last(0)
+    {
+    }
+
+    void acceptNewBestValue(double bestVal)
+    {
+        int k = (int)(-bestVal + 0.5);
+        if (k > 0 && k <= s_shared.numValues && s_shared.accepted[k] == 0)
+        {
+            s_shared.accepted[k] = now();
+        }
+        _last = std::max(_last, k);
+    }
+
+    int last() const
+    {
+        return _last;
+    }
+
+ private:
+    int _last;
+};
+
+/// Spins for about the time a solver spends between two polls
+static void work(double seconds)
+{
+    double end = now() + seconds;
+    while (now() < end)
+    {
+    }
+}
+
+static int runProducer(double gap, double)
+{
+    g_portInterface.setQuiet(true);
+    g_portInterface.initialize(true);
+    for (int k = 1; k <= s_shared.numValues; ++k)
+    {
+        work(gap);
+        s_shared.found[k] = now();
+        g_portInterface.setBestValue(-k, true);
+    }
+    g_portInterface.writeResult("stopped", -s_shared.numValues);
+    return 0;
+}
+
+static int runConsumer(double poll, double timeout)
+{
+    g_portInterface.setQuiet(true);
+    g_portInterface.initialize(true);
+    TimingAcceptor acceptor;
+    double end = now() + timeout;
+    while (acceptor.last() < s_shared.numValues && now() < end)
+    {
+        work(poll);
+        g_portInterface.getBestValue(acceptor);
+    }
+    g_portInterface.writeResult("stopped", -acceptor.last());
+    return 0;
+}
+
+struct Child
+{
+    pid_t pid;
+    /// Reads what the child writes to fd 4
+    int in;
+    /// Writes what the child reads from fd 3
+    int out;
+};
+
+static int s_maxFd = 5;
+
+static Child startChild(int (*run)(double, double), double a, double b)
+{
+    int toChild[2], fromChild[2];
+    if (pipe(toChild) || pipe(fromChild))
+    {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    Child child;
+    child.pid = fork();
+    if (child.pid < 0)
+    {
+        fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (child.pid == 0)
+    {
+        dup2(toChild[0], 3);
+        dup2(fromChild[1], 4);
+        // Also the pipes of the other child, so their ends see EOF
+        for (int fd = 5; fd < s_maxFd; ++fd)
+        {
+            close(fd);
+        }
+        _exit(run(a, b));
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+    s_maxFd = std::max(s_maxFd, std::max(toChild[1], fromChild[0]) + 1);
+    child.in = fromChild[0];
+    child.out = toChild[1];
+    return child;
+}
+
+static bool readFull(int fd, unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t ret = read(fd, buf + got, len - got);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        got += ret;
+    }
+    return true;
+}
+
+static bool writeFull(int fd, const unsigned char *buf, size_t len)
+{
+    size_t wrote = 0;
+    while (wrote < len)
+    {
+        ssize_t ret = write(fd, buf + wrote, len - wrote);
+        if (ret <= 0)
+        {
+            return false;
+        }
+        wrote += ret;
+    }
+    return true;
+}
+
+/**
+ * Forwards incumbents of the producer to the consumer as <<1, Value>> until
+ * the producer sends its result, returns the number forwarded.
+ */
+static int relay(const Child &producer, const Child &consumer, int protocol)
+{
+    int lenBytes = protocol < 2 ? 2 : 4;
+    int forwarded = 0;
+    std::vector<unsigned char> buf;
+    while (true)
+    {
+        unsigned char header[4];
+        if (!readFull(producer.in, header, lenBytes))
+        {
+            return forwarded;
+        }
+        size_t len = 0;
+        for (int i = 0; i < lenBytes; ++i)
+        {
+            len = (len << 8) | header[i];
+        }
+        buf.resize(len);
+        if (len == 0 || !readFull(producer.in, &(buf[0]), len))
+        {
+            return forwarded;
+        }
+        // Incumbents are <<3, Value>> or <<5, Value, ...>>, the result <<2, ...>>
+        if (buf[0] == 2)
+        {
+            return forwarded;
+        }
+        if ((buf[0] != 3 && buf[0] != 5) || len < 9)
+        {
+            continue;
+        }
+        unsigned char msg[4 + 9];
+        for (int i = 0; i < lenBytes; ++i)
+        {
+            msg[i] = (9 >> (8 * (lenBytes - 1 - i))) & 0xFF;
+        }
+        msg[lenBytes] = 1;
+        memcpy(msg + lenBytes + 1, &(buf[1]), 8);
+        if (!writeFull(consumer.out, msg, lenBytes + 9))
+        {
+            return forwarded;
+        }
+        ++forwarded;
+    }
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+int main(int, char **argv)
+{
+    int numValues = 10000;
+    double gap = 100e-6;
+    double poll = 10e-6;
+    double publishInterval = 0;
+    int protocol = 2;
+    for (char **p = argv + 1; *p; ++p)
+    {
+        if (!strcmp(*p, "-n") && *(p + 1))
+        {
+            numValues = atoi(*++p);
+        }
+        else if (!strcmp(*p, "-g") && *(p + 1))
+        {
+            gap = atof(*++p) * 1e-6;
+        }
+        else if (!strcmp(*p, "-u") && *(p + 1))
+        {
+            poll = atof(*++p) * 1e-6;
+        }
+        else if (!strcmp(*p, "-w") && *(p + 1))
+        {
+            publishInterval = atof(*++p);
+        }
+        else if (!strcmp(*p, "-p"))
+        {
+            protocol = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n <values>] [-g <microseconds between values>] [-u <microseconds between polls>] [-w <seconds between incumbents>] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (numValues <= 0)
+    {
+        fprintf(stderr, "Number of values must be positive\n");
+        return 1;
+    }
+
+    size_t size = 2 * (numValues + 1) * sizeof(double);
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+        return 1;
+    }
+    memset(mem, 0, size);
+    s_shared.found = (double *)mem;
+    s_shared.accepted = s_shared.found + numValues + 1;
+    s_shared.numValues = numValues;
+
+    // Keeps the pipes off fds 3 and 4 the children use
+    while (dup(2) < 4)
+    {
+    }
+
+    // Both children inherit the settings
+    g_portInterface.setProtocol(protocol);
+    g_portInterface.setPublishInterval(publishInterval);
+    g_portInterface.setProgressInterval(0);
+
+    double timeout = 10 + numValues * (gap + publishInterval) * 2;
+    Child consumer = startChild(runConsumer, poll, timeout);
+    Child producer = startChild(runProducer, gap, 0);
+
+    double start = now();
+    int forwarded = relay(producer, consumer, protocol);
+    int status;
+    waitpid(producer.pid, &status, 0);
+    waitpid(consumer.pid, &status, 0);
+    double elapsed = now() - start;
+    close(producer.in);
+    close(producer.out);
+    close(consumer.in);
+    close(consumer.out);
+
+    std::vector<double> latencies;
+    for (int k = 1; k <= numValues; ++k)
+    {
+        if (s_shared.accepted[k] > 0 && s_shared.found[k] > 0)
+        {
+            latencies.push_back(s_shared.accepted[k] - s_shared.found[k]);
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (size_t i = 0; i < latencies.size(); ++i)
+    {
+        sum += latencies[i];
+    }
+
+    printf("protocol %d, %d values %.0f us apart, polls %.0f us apart, publish interval %g s\n",
+        protocol, numValues, gap * 1e6, poll * 1e6, publishInterval);
+    printf("forwarded %d, accepted %d (%.1f%%), %.0f messages/s\n",
+        forwarded, (int)latencies.size(), 100.0 * latencies.size() / numValues,
+        forwarded / elapsed);
+    if (!latencies.empty())
+    {
+        printf("latency us: mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+            sum / latencies.size() * 1e6, percentile(latencies, 0.5) * 1e6,
+            percentile(latencies, 0.9) * 1e6, percentile(latencies, 0.99) * 1e6,
+            latencies.back() * 1e6);
+    }
+
+    munmap(mem, size);
+    return latencies.empty() ? 1 : 0;
+}
@@ -1,6 +1,12 @@
 #include "ErlPortInterface.h"
+#include "delta.h"
 #include "reader_nl.h"
 #include "event_all.h"
+#include "event_estimate.h"
+#include "checkpoint.h"
+#include "LogSink.h"
+#include "ModelImage.h"
+#include "affinity.h"
 
 #include "scip/scip.h"
 #include "scip/scipdefplugins.h"
@@ -8,23 +14,240 @@
 #include <stdio.h>
 #include <string.h>
 #include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
 #include <signal.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
 
 ErlPortInterface g_portInterface;
 
-static SCIP_RETCODE run(const char *nlfile, const char *logFileName)
+static SCIP_RETCODE applyBounds(SCIP *scip, const Bounds &bounds)
+{
+    SCIP_VAR **vars = SCIPgetOrigVars(scip);
+    int nvars = SCIPgetNOrigVars(scip);
+
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        const VarBound &b = bounds[i];
+        if (b.var < 0 || b.var >= nvars)
+        {
+            SCIPerrorMessage("variable %d out of range in delta\n", b.var);
+            return SCIP_INVALIDDATA;
+        }
+        if (b.lb > SCIPvarGetLbOriginal(vars[b.var]))
+        {
+            SCIP_CALL( SCIPchgVarLb(scip, vars[b.var], b.lb) );
+        }
+        if (b.ub < SCIPvarGetUbOriginal(vars[b.var]))
+        {
+            SCIP_CALL( SCIPchgVarUb(scip, vars[b.var], b.ub) );
+        }
+    }
+    return SCIP_OKAY;
+}
+
+/// What solving one subproblem ended with
+struct RunResult
+{
+    RunResult()
+        : status("stopped"), bestVal(1e23)
+    {
+    }
+    std::string status;
+    double bestVal;
+};
+
+/// A stub with the bounds of a delta or of a resumed node
+struct Subproblem
+{
+    std::string nlfile;
+    /// Delta or stub path, for messages
+    std::string name;
+    std::string solFileName;
+    Bounds bounds;
+};
+
+/// With -z the logs are gzip streams of a LogSink
+static bool s_compressLog = false;
+
+static SCIP_DECL_MESSAGEINFO(logSinkMessage)
+{
+    LogSink *sink = (LogSink *)SCIPmessagehdlrGetData(messagehdlr);
+    sink->write(msg, strlen(msg));
+}
+
+/// All output of scip goes to the log file, through sink if compressed
+static SCIP_RETCODE setLogFile(SCIP *scip, const char *logFileName,
+    LogSink &sink)
+{
+    if (!s_compressLog)
+    {
+        SCIPsetMessagehdlrLogfile(scip, logFileName);
+        SCIPsetMessagehdlrQuiet(scip, true);
+        return SCIP_OKAY;
+    }
+    SCIP_MESSAGEHDLR *messagehdlr;
+    SCIP_CALL( SCIPmessagehdlrCreate(&messagehdlr, TRUE, NULL, FALSE,
+            logSinkMessage, logSinkMessage, logSinkMessage, NULL,
+            (SCIP_MESSAGEHDLRDATA *)&sink) );
+    SCIP_CALL( SCIPsetMessagehdlr(scip, messagehdlr) );
+    SCIP_CALL( SCIPmessagehdlrRelease(&messagehdlr) );
+    return SCIP_OKAY;
+}
+
+/// With -m every subproblem is built from this image, mapped once
+static ModelImage *s_image = NULL;
+
+/// The problem of the image as the NL reader would create it, in order
+static SCIP_RETCODE createProbImage(SCIP *scip, const ModelImage &image,
+    const std::string &name)
+{
+    SCIP_CALL( SCIPcreateProbBasic(scip, name.c_str()) );
+    SCIP_Real inf = SCIPinfinity(scip);
+    int n = image.numVars();
+    std::vector<SCIP_VAR *> vars(n);
+    for (int i = 0; i < n; ++i)
+    {
+        SCIP_Real lb = std::max(-inf, image.varLb()[i]);
+        SCIP_Real ub = std::min(inf, image.varUb()[i]);
+        SCIP_VARTYPE type = SCIP_VARTYPE_CONTINUOUS;
+        if (image.isInteger(i))
+        {
+            type = lb >= 0 && ub <= 1 ? SCIP_VARTYPE_BINARY : SCIP_VARTYPE_INTEGER;
+        }
+        SCIP_CALL( SCIPcreateVarBasic(scip, &vars[i], image.varName(i), lb, ub,
+                image.obj()[i], type) );
+        SCIP_CALL( SCIPaddVar(scip, vars[i]) );
+    }
+
+    std::vector<SCIP_VAR *> rowVars;
+    std::vector<SCIP_Real> rowValues;
+    for (int c = 0; c < image.numCons(); ++c)
+    {
+        rowVars.clear();
+        rowValues.clear();
+        for (int64_t k = image.rowStart()[c]; k < image.rowStart()[c + 1]; ++k)
+        {
+            rowVars.push_back(vars[image.colIndex()[k]]);
+            rowValues.push_back(image.values()[k]);
+        }
+        SCIP_CONS *cons;
+        SCIP_CALL( SCIPcreateConsBasicLinear(scip, &cons, image.conName(c),
+                rowVars.size(), rowVars.empty() ? NULL : &(rowVars[0]),
+                rowValues.empty() ? NULL : &(rowValues[0]),
+                std::max(-inf, image.conLb()[c]), std::min(inf, image.conUb()[c])) );
+        SCIP_CALL( SCIPaddCons(scip, cons) );
+        SCIP_CALL( SCIPreleaseCons(scip, &cons) );
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        SCIP_CALL( SCIPreleaseVar(scip, &vars[i]) );
+    }
+
+    if (!image.minimize())
+    {
+        SCIP_CALL( SCIPsetObjsense(scip, SCIP_OBJSENSE_MAXIMIZE) );
+    }
+    if (image.objConstant() != 0)
+    {
+        SCIP_CALL( SCIPaddOrigObjoffset(scip, image.objConstant()) );
+    }
+    return SCIP_OKAY;
+}
+
+/// Writes the .sol file of the subproblem, by the NL reader without -m
+static SCIP_RETCODE writeSolution(SCIP *scip, const std::string &nlfile,
+    const std::string &solFileName)
+{
+    if (s_image == NULL)
+    {
+        // The reader names the solution after the stub
+        SCIP_CALL( SCIPwriteAmplSolReaderNl(scip, NULL) );
+        if (solFileName != solNameNL(nlfile))
+        {
+            rename(solNameNL(nlfile).c_str(), solFileName.c_str());
+        }
+        return SCIP_OKAY;
+    }
+
+    SCIP_SOL *sol = SCIPgetBestSol(scip);
+    std::vector<double> x;
+    if (sol != NULL)
+    {
+        x.resize(SCIPgetNOrigVars(scip));
+        SCIP_CALL( SCIPgetSolVals(scip, sol, x.size(), SCIPgetOrigVars(scip),
+                x.empty() ? NULL : &(x[0])) );
+    }
+    const char *message = "SCIP: limit reached";
+    int solveResult = 400;
+    switch (SCIPgetStatus(scip))
+    {
+    case SCIP_STATUS_OPTIMAL:
+        message = "SCIP: optimal solution found";
+        solveResult = 0;
+        break;
+    case SCIP_STATUS_INFEASIBLE:
+        message = "SCIP: problem is infeasible";
+        solveResult = 200;
+        break;
+    default:
+        break;
+    }
+    if (!s_image->writeSolution(solFileName, message,
+            sol != NULL ? &(x[0]) : NULL, solveResult))
+    {
+        return SCIP_WRITEERROR;
+    }
+    return SCIP_OKAY;
+}
+
+/// The NL reader and the solution writer use the global ASL state
+static pthread_mutex_t s_aslMutex = PTHREAD_MUTEX_INITIALIZER;
+/// Value written to each solution file, guarded by s_aslMutex
+static std::map<std::string, double> s_solValues;
+
+/// Creates the problem of the image or reads the stub, then sets the bounds
+static SCIP_RETCODE readSubproblem(SCIP *scip, const Subproblem &subproblem)
+{
+    SCIP_RETCODE retcode;
+    if (s_image != NULL)
+    {
+        retcode = createProbImage(scip, *s_image, subproblem.name);
+    }
+    else
+    {
+        pthread_mutex_lock(&s_aslMutex);
+        retcode = SCIPreadProb(scip, subproblem.nlfile.c_str(), NULL);
+        pthread_mutex_unlock(&s_aslMutex);
+    }
+    SCIP_CALL( retcode );
+
+    SCIP_CALL( applyBounds(scip, subproblem.bounds) );
+    return SCIP_OKAY;
+}
+
+static SCIP_RETCODE run(const Subproblem &subproblem, const char *logFileName,
+    CheckpointWriter *checkpoint, size_t slot, RunResult &result)
 {
     SCIP* scip;
     char buffer[SCIP_MAXSTRLEN];
-
-    assert(nlfile != NULL);
+    // Outlives scip, closed by its destructor
+    LogSink sink;
 
     SCIP_CALL( SCIPcreate(&scip) );
 
     if (logFileName != NULL)
     {
-        SCIPsetMessagehdlrLogfile(scip, logFileName);
-        SCIPsetMessagehdlrQuiet(scip, true);
+        if (s_compressLog)
+        {
+            sink.open(logFileName);
+        }
+        SCIP_CALL( setLogFile(scip, logFileName, sink) );
     }
 
     SCIPprintVersion(scip, NULL);
@@ -39,28 +262,66 @@ static SCIP_RETCODE run(const char *nlfile, const char *logFileName)
 
     SCIPreadParams(scip, "scip.set");
 
-    SCIP_CALL( SCIPreadProb(scip, nlfile, NULL) );
+    SCIP_CALL( readSubproblem(scip, subproblem) );
+
+    // Exported nodes are deltas of the same stub
+    std::string base(subproblem.nlfile);
+    size_t delim = base.find_last_of("/\\");
+    if (delim != std::string::npos)
+    {
+        base = base.substr(delim + 1);
+    }
+    SCIP_CALL( SCIPsetEventHdlrAllSubproblem(scip, base, subproblem.bounds) );
+    if (checkpoint != NULL)
+    {
+        SCIP_CALL( SCIPsetEventHdlrAllCheckpoint(scip, checkpoint, slot,
+                subproblem.nlfile, subproblem.solFileName) );
+    }
+
     SCIP_CALL( SCIPsolve(scip) );
-    
-    SCIP_CALL( SCIPwriteAmplSolReaderNl(scip, NULL) );
+    SCIP_CALL( SCIPreportEventHdlrAllProgress(scip) );
 
     SCIP_SOL *bestSol = SCIPgetBestSol(scip);
-    double bestVal = 1e23;
+    result.bestVal = 1e23;
     if (bestSol)
     {
-        bestVal = SCIPgetSolOrigObj(scip, bestSol);
+        result.bestVal = SCIPgetSolOrigObj(scip, bestSol);
+    }
+    // The slot of a finished subproblem is cleared, keep its incumbent
+    if (checkpoint != NULL && bestSol != NULL)
+    {
+        std::vector<double> x(SCIPgetNOrigVars(scip));
+        SCIP_CALL( SCIPgetSolVals(scip, bestSol, x.size(), SCIPgetOrigVars(scip),
+                x.empty() ? NULL : &(x[0])) );
+        checkpoint->setIncumbent(result.bestVal, subproblem.nlfile,
+            subproblem.solFileName, x);
     }
+    
+    // The reader names the solution after the stub, move it before another
+    // subproblem of the same stub writes its own. Subproblems sharing a
+    // solution file keep the best solution there.
+    SCIP_RETCODE retcode = SCIP_OKAY;
+    pthread_mutex_lock(&s_aslMutex);
+    std::map<std::string, double>::iterator it
+        = s_solValues.find(subproblem.solFileName);
+    if (it == s_solValues.end() || isBetter(it->second, result.bestVal))
+    {
+        retcode = writeSolution(scip, subproblem.nlfile, subproblem.solFileName);
+        s_solValues[subproblem.solFileName] = result.bestVal;
+    }
+    pthread_mutex_unlock(&s_aslMutex);
+    SCIP_CALL( retcode );
 
     switch (SCIPgetStatus(scip))
     {
     case SCIP_STATUS_OPTIMAL:
-        g_portInterface.writeResult("optimal", bestVal);
+        result.status = "optimal";
         break;
     case SCIP_STATUS_INFEASIBLE:
-        g_portInterface.writeResult("infeasible", bestVal);
+        result.status = "infeasible";
         break;
     default:
-        g_portInterface.writeResult("stopped", bestVal);
+        result.status = "stopped";
     }
 
     SCIP_CALL( SCIPfree(&scip) );
@@ -68,22 +329,601 @@ static SCIP_RETCODE run(const char *nlfile, const char *logFileName)
     return SCIP_OKAY;
 }
 
+/**
+ * Writes the incumbent saved in a checkpoint to its solution file. The
+ * solution is added to the unsolved problem of its stub without checks,
+ * it was feasible when it was found.
+ */
+static SCIP_RETCODE writeResumedSolution(const Checkpoint &resumed)
+{
+    SCIP* scip;
+    SCIP_CALL( SCIPcreate(&scip) );
+    SCIPsetMessagehdlrQuiet(scip, TRUE);
+    SCIP_CALL( SCIPincludeDefaultPlugins(scip) );
+    SCIP_CALL( SCIPincludeReaderNl(scip) );
+
+    Subproblem subproblem;
+    subproblem.nlfile = resumed.nlfile;
+    subproblem.name = resumed.nlfile;
+    subproblem.solFileName = resumed.solFileName;
+    SCIP_CALL( readSubproblem(scip, subproblem) );
+
+    SCIP_SOL *sol;
+    SCIP_CALL( SCIPcreateOrigSol(scip, &sol, NULL) );
+    SCIP_VAR **vars = SCIPgetOrigVars(scip);
+    int nvars = std::min((int)resumed.x.size(), SCIPgetNOrigVars(scip));
+    for (int i = 0; i < nvars; ++i)
+    {
+        SCIP_CALL( SCIPsetSolVal(scip, sol, vars[i], resumed.x[i]) );
+    }
+    SCIP_Bool stored;
+    SCIP_CALL( SCIPaddSolFree(scip, &sol, &stored) );
+
+    SCIP_RETCODE retcode = SCIP_OKAY;
+    pthread_mutex_lock(&s_aslMutex);
+    retcode = writeSolution(scip, subproblem.nlfile, subproblem.solFileName);
+    pthread_mutex_unlock(&s_aslMutex);
+    SCIP_CALL( retcode );
+
+    SCIP_CALL( SCIPfree(&scip) );
+    return SCIP_OKAY;
+}
+
+static bool makeSubproblem(const char *stub, const char *deltaFileName,
+    Subproblem &subproblem)
+{
+    subproblem.nlfile = stub;
+    subproblem.name = stub;
+    subproblem.solFileName = solNameNL(stub);
+
+    size_t len = strlen(stub);
+    if (deltaFileName == NULL
+        && (len < 6 || strcmp(stub + len - 6, ".delta")))
+    {
+        return true;
+    }
+    if (deltaFileName == NULL)
+    {
+        deltaFileName = stub;
+    }
+
+    std::string base;
+    if (!readDelta(deltaFileName, base, subproblem.bounds))
+    {
+        return false;
+    }
+    subproblem.name = deltaFileName;
+    subproblem.solFileName = solNameNL(deltaNameNL(deltaFileName));
+    if (deltaFileName == stub)
+    {
+        // The base file name is relative to the delta file's directory
+        size_t delim = subproblem.name.find_last_of("/\\");
+        subproblem.nlfile = delim == std::string::npos ? base
+            : subproblem.name.substr(0, delim + 1) + base;
+    }
+    return true;
+}
+
+/// Time limit of -E unless limits/time is given after --
+const double DEFAULT_ESTIMATE_TIME = 60;
+
+/**
+ * Runs a time limited B&B on the subproblem and prints to stdout the tree
+ * size estimate and the splits event_estimate recommends for numCores.
+ * The SCIP log only goes to the log file.
+ */
+static SCIP_RETCODE estimate(const Subproblem &subproblem,
+    const char *logFileName, int numCores)
+{
+    SCIP* scip;
+    // Outlives scip, closed by its destructor
+    LogSink sink;
+
+    SCIP_CALL( SCIPcreate(&scip) );
+
+    if (logFileName != NULL)
+    {
+        if (s_compressLog)
+        {
+            sink.open(logFileName);
+        }
+        SCIP_CALL( setLogFile(scip, logFileName, sink) );
+    }
+    else
+    {
+        SCIPsetMessagehdlrQuiet(scip, TRUE);
+    }
+
+    SCIP_CALL( SCIPincludeDefaultPlugins(scip) );
+    SCIP_CALL( SCIPincludeReaderNl(scip) );
+    SCIP_CALL( SCIPincludeEventHdlrEstimate(scip) );
+
+    SCIP_CALL( SCIPsetRealParam(scip, "limits/time", DEFAULT_ESTIMATE_TIME) );
+    SCIPreadParams(scip, "scip.set");
+
+    SCIP_CALL( readSubproblem(scip, subproblem) );
+    SCIP_CALL( SCIPsolve(scip) );
+    SCIP_CALL( SCIPprintEventHdlrEstimate(scip, numCores, stdout) );
+
+    SCIP_CALL( SCIPfree(&scip) );
+    return SCIP_OKAY;
+}
+
+/**
+ * Solves the subproblems of one process on a pool of threads, each with
+ * its own SCIP instance. The solvers share g_portInterface, so a value
+ * found by one of them reaches the others directly and only the best
+ * value of the process is sent to Erlang. With a checkpoint every
+ * subproblem has a slot, cleared once it is solved.
+ */
+class SolverPool
+{
+ public:
+    SolverPool(const std::vector<Subproblem> &subproblems,
+        const char *logFileName, bool quiet, CheckpointWriter *checkpoint)
+        : _subproblems(subproblems), _logFileName(logFileName),
+          _quiet(quiet), _checkpoint(checkpoint), _next(0), _numWorkers(0),
+          _failed(false)
+    {
+        pthread_mutex_init(&_mutex, NULL);
+        for (size_t i = 0; _checkpoint != NULL && i < _subproblems.size(); ++i)
+        {
+            CheckpointNode node;
+            node.nlfile = _subproblems[i].nlfile;
+            node.solFileName = _subproblems[i].solFileName;
+            node.bounds = _subproblems[i].bounds;
+            _checkpoint->setNodes(i, CheckpointNodes(1, node));
+        }
+    }
+
+    ~SolverPool()
+    {
+        pthread_mutex_destroy(&_mutex);
+    }
+
+    /// Worker i runs on cpus[i] alone, the ones past the end on all CPUs
+    void setWorkerCpus(const std::vector<int> &cpus)
+    {
+        _workerCpus = cpus;
+    }
+
+    /// Returns false if any of the subproblems failed
+    bool run(int numThreads, RunResult &total)
+    {
+        std::vector<pthread_t> threads;
+        for (int i = 0; i < numThreads && i < (int)_subproblems.size(); ++i)
+        {
+            pthread_t thread;
+            int ret;
+            if ((ret = pthread_create(&thread, NULL, workerLoop, this)))
+            {
+                fprintf(stderr, ">>> pthread_create() failed with %d\n", ret);
+                exit(1);
+            }
+            threads.push_back(thread);
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            pthread_join(threads[i], NULL);
+        }
+
+        // Optimal if every subproblem is solved and some has a solution
+        total = _total;
+        if (_numByStatus["stopped"] > 0)
+        {
+            total.status = "stopped";
+        }
+        else if (_numByStatus["optimal"] > 0)
+        {
+            total.status = "optimal";
+        }
+        else
+        {
+            total.status = "infeasible";
+        }
+
+        if (_checkpoint != NULL)
+        {
+            if (!_failed && total.status != "stopped")
+            {
+                _checkpoint->remove();
+            }
+            else
+            {
+                _checkpoint->write();
+            }
+        }
+        return !_failed;
+    }
+
+ private:
+    std::vector<Subproblem> _subproblems;
+    const char *_logFileName;
+    bool _quiet;
+    CheckpointWriter *_checkpoint;
+    size_t _next;
+    size_t _numWorkers;
+    std::vector<int> _workerCpus;
+    bool _failed;
+    RunResult _total;
+    std::map<std::string, int> _numByStatus;
+    pthread_mutex_t _mutex;
+
+    static void *workerLoop(void *ptr)
+    {
+        SolverPool *This = (SolverPool *)ptr;
+
+        // A SCIP instance is one thread, it keeps its caches on one core
+        pthread_mutex_lock(&This->_mutex);
+        size_t worker = This->_numWorkers++;
+        pthread_mutex_unlock(&This->_mutex);
+        if (worker < This->_workerCpus.size())
+        {
+            setThreadAffinity(std::vector<int>(1, This->_workerCpus[worker]));
+        }
+
+        while (true)
+        {
+            pthread_mutex_lock(&This->_mutex);
+            size_t i = This->_next++;
+            pthread_mutex_unlock(&This->_mutex);
+            if (i >= This->_subproblems.size())
+            {
+                return NULL;
+            }
+
+            const Subproblem &subproblem = This->_subproblems[i];
+            std::string logFileName;
+            if (This->_logFileName != NULL)
+            {
+                logFileName = This->_logFileName;
+            }
+            if (This->_logFileName != NULL && This->_subproblems.size() > 1)
+            {
+                char suffix[32];
+                sprintf(suffix, ".%lu", i);
+                logFileName += suffix;
+            }
+            RunResult result;
+            SCIP_RETCODE retcode = ::run(subproblem,
+                logFileName.empty() ? NULL : logFileName.c_str(),
+                This->_checkpoint, i, result);
+
+            pthread_mutex_lock(&This->_mutex);
+            if (retcode != SCIP_OKAY)
+            {
+                SCIPprintError(retcode);
+                This->_failed = true;
+            }
+            else
+            {
+                if (!This->_quiet && This->_subproblems.size() > 1)
+                {
+                    fprintf(stderr, ">>> %s: %s, %lf\n",
+                        subproblem.name.c_str(), result.status.c_str(),
+                        result.bestVal);
+                }
+                This->merge(result);
+                if (This->_checkpoint != NULL && result.status != "stopped")
+                {
+                    This->_checkpoint->setNodes(i, CheckpointNodes());
+                }
+            }
+            pthread_mutex_unlock(&This->_mutex);
+        }
+    }
+
+    // Called with _mutex held
+    void merge(const RunResult &result)
+    {
+        if (isBetter(_total.bestVal, result.bestVal))
+        {
+            _total.bestVal = result.bestVal;
+        }
+        ++_numByStatus[result.status];
+    }
+};
+
+/**
+ * Solves jobs one after another with one SCIP instance. While the stub
+ * stays the same, only the transformed problem is freed between jobs and
+ * the original bounds are restored, so plugins, parameters and the parsed
+ * problem are reused.
+ */
+class SolverServer
+{
+ public:
+    explicit SolverServer(const char *logFileName)
+        : _scip(NULL), _logFileName(logFileName)
+    {
+        // One log for all the jobs
+        if (_logFileName != NULL && s_compressLog)
+        {
+            _sink.open(_logFileName);
+        }
+    }
+
+    ~SolverServer()
+    {
+        if (_scip != NULL)
+        {
+            SCIPfree(&_scip);
+        }
+        if (!_paramFileName.empty())
+        {
+            remove(_paramFileName.c_str());
+        }
+    }
+
+    SCIP_RETCODE solve(const Subproblem &subproblem,
+        const std::vector<std::string> &params, RunResult &result)
+    {
+        if (_scip != NULL && _nlfile != subproblem.nlfile)
+        {
+            SCIP_CALL( SCIPfree(&_scip) );
+        }
+        if (_scip == NULL)
+        {
+            SCIP_CALL( create(subproblem.nlfile) );
+        }
+        else
+        {
+            SCIP_CALL( SCIPfreeTransform(_scip) );
+            // The cutoff of the last job, the acceptor sets the current one
+            SCIP_CALL( SCIPsetObjlimit(_scip,
+                    SCIPgetObjsense(_scip) == SCIP_OBJSENSE_MAXIMIZE
+                    ? -SCIPinfinity(_scip) : SCIPinfinity(_scip)) );
+            SCIP_VAR **vars = SCIPgetOrigVars(_scip);
+            for (size_t i = 0; i < _lb.size(); ++i)
+            {
+                SCIP_CALL( SCIPchgVarLb(_scip, vars[i], _lb[i]) );
+                SCIP_CALL( SCIPchgVarUb(_scip, vars[i], _ub[i]) );
+            }
+        }
+
+        SCIP_CALL( SCIPresetParams(_scip) );
+        SCIPreadParams(_scip, "scip.set");
+        if (!params.empty())
+        {
+            SCIP_CALL( readJobParams(params) );
+        }
+
+        SCIP_CALL( applyBounds(_scip, subproblem.bounds) );
+        std::string base(subproblem.nlfile);
+        size_t delim = base.find_last_of("/\\");
+        if (delim != std::string::npos)
+        {
+            base = base.substr(delim + 1);
+        }
+        SCIP_CALL( SCIPsetEventHdlrAllSubproblem(_scip, base, subproblem.bounds) );
+
+        SCIP_CALL( SCIPsolve(_scip) );
+        SCIP_CALL( SCIPreportEventHdlrAllProgress(_scip) );
+
+        SCIP_SOL *bestSol = SCIPgetBestSol(_scip);
+        result.bestVal = bestSol ? SCIPgetSolOrigObj(_scip, bestSol) : 1e23;
+
+        SCIP_CALL( writeSolution(_scip, subproblem.nlfile, subproblem.solFileName) );
+
+        switch (SCIPgetStatus(_scip))
+        {
+        case SCIP_STATUS_OPTIMAL:
+            result.status = "optimal";
+            break;
+        case SCIP_STATUS_INFEASIBLE:
+            result.status = "infeasible";
+            break;
+        default:
+            result.status = "stopped";
+        }
+        return SCIP_OKAY;
+    }
+
+ private:
+    SCIP *_scip;
+    const char *_logFileName;
+    LogSink _sink;
+    std::string _nlfile;
+    std::vector<double> _lb;
+    std::vector<double> _ub;
+    /// Temporary file of this process for the set lines of a job
+    std::string _paramFileName;
+
+    SCIP_RETCODE readJobParams(const std::vector<std::string> &params)
+    {
+        if (_paramFileName.empty())
+        {
+            const char *dir = getenv("TMPDIR");
+            std::string name(std::string(dir != NULL ? dir : "/tmp")
+                + "/scip_port-XXXXXX.set");
+            std::vector<char> buf(name.begin(), name.end());
+            buf.push_back('\0');
+            int fd = mkstemps(&(buf[0]), 4);
+            if (fd < 0)
+            {
+                fprintf(stderr, ">>> Failed to create %s: %s\n", name.c_str(),
+                    strerror(errno));
+                return SCIP_FILECREATEERROR;
+            }
+            close(fd);
+            _paramFileName = &(buf[0]);
+        }
+        std::ofstream f(_paramFileName.c_str());
+        for (size_t i = 0; i < params.size(); ++i)
+        {
+            f << params[i] << std::endl;
+        }
+        f.close();
+        SCIPreadParams(_scip, _paramFileName.c_str());
+        return SCIP_OKAY;
+    }
+
+    SCIP_RETCODE create(const std::string &nlfile)
+    {
+        SCIP_CALL( SCIPcreate(&_scip) );
+        if (_logFileName != NULL)
+        {
+            SCIP_CALL( setLogFile(_scip, _logFileName, _sink) );
+        }
+        SCIP_CALL( SCIPincludeDefaultPlugins(_scip) );
+        SCIP_CALL( SCIPincludeReaderNl(_scip) );
+        SCIP_CALL( SCIPincludeEventHdlrAll(_scip) );
+        if (s_image != NULL)
+        {
+            SCIP_CALL( createProbImage(_scip, *s_image, nlfile) );
+        }
+        else
+        {
+            SCIP_CALL( SCIPreadProb(_scip, nlfile.c_str(), NULL) );
+        }
+        _nlfile = nlfile;
+
+        SCIP_VAR **vars = SCIPgetOrigVars(_scip);
+        int nvars = SCIPgetNOrigVars(_scip);
+        _lb.resize(nvars);
+        _ub.resize(nvars);
+        for (int i = 0; i < nvars; ++i)
+        {
+            _lb[i] = SCIPvarGetLbOriginal(vars[i]);
+            _ub[i] = SCIPvarGetUbOriginal(vars[i]);
+        }
+        return SCIP_OKAY;
+    }
+
+    SolverServer(const SolverServer &);
+    SolverServer &operator=(const SolverServer &);
+};
+
+/**
+ * A job is text: a "stub <path>" line, optionally "delta <path>",
+ * "best <value>" and any number of "set <SCIP parameter line>".
+ */
+static bool parseJob(const std::string &job, Subproblem &subproblem,
+    std::vector<std::string> &params, bool &hasBest, double &best)
+{
+    std::istringstream in(job);
+    std::string line;
+    std::string stub;
+    std::string delta;
+    params.clear();
+    hasBest = false;
+    while (std::getline(in, line))
+    {
+        std::istringstream s(line);
+        std::string kind;
+        s >> kind;
+        if (kind == "stub")
+        {
+            s >> stub;
+        }
+        else if (kind == "delta")
+        {
+            s >> delta;
+        }
+        else if (kind == "best")
+        {
+            std::string value;
+            s >> value;
+            hasBest = true;
+            best = strtod(value.c_str(), NULL);
+        }
+        else if (kind == "set")
+        {
+            params.push_back(line.substr(line.find("set") + 3));
+        }
+    }
+    if (stub.empty())
+    {
+        fprintf(stderr, ">>> No stub in job\n");
+        return false;
+    }
+    return makeSubproblem(stub.c_str(), delta.empty() ? NULL : delta.c_str(),
+        subproblem);
+}
+
+/// First in scip.set, so that SCIP args given after -- win
+static void writeVerbosity(std::ofstream &f, const char *verbosity)
+{
+    if (verbosity != NULL)
+    {
+        f << "display/verblevel = " << verbosity << std::endl;
+    }
+}
+
+static int serve(const char *logFileName)
+{
+    SolverServer server(logFileName);
+    unsigned id;
+    std::string job;
+    std::string lastStub;
+    while (g_portInterface.waitJob(id, job))
+    {
+        Subproblem subproblem;
+        std::vector<std::string> params;
+        RunResult result;
+        bool hasBest;
+        double best = 0;
+        if (!parseJob(job, subproblem, params, hasBest, best))
+        {
+            g_portInterface.writeJobResult(id, "error", result.bestVal);
+            continue;
+        }
+        // An incumbent is only a cutoff for the jobs of its own stub
+        if (subproblem.nlfile != lastStub)
+        {
+            g_portInterface.resetBestValue();
+            lastStub = subproblem.nlfile;
+        }
+        if (hasBest)
+        {
+            g_portInterface.setBestValue(best, false);
+        }
+        SCIP_RETCODE retcode = server.solve(subproblem, params, result);
+        if (retcode != SCIP_OKAY)
+        {
+            SCIPprintError(retcode);
+            return -1;
+        }
+        g_portInterface.writeJobResult(id, result.status, result.bestVal);
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     signal(SIGINT, SIG_IGN);
 
     if (argc < 2)
     {
-        fprintf(stderr, "Usage: %s <AMPL stub path> [-p] [-o <log file>] [-b <best solution value>] [-- SCIP args]\n", argv[0]);
+        fprintf(stderr, "Usage: %s <AMPL stub path>... [-p | -P] [-o <log file>] [-b <best solution value>] [-d <delta file>] [-w <seconds between incumbents>] [-r <seconds between progress reports>] [-j <threads>] [-c <checkpoint file> [-C <seconds between checkpoints>]] [-z] [-V <verbosity>] [-m <model image>] [-a <CPU list>] [-s] [-- SCIP args]\n"
+            "       %s <AMPL stub path> -E <cores> [-o <log file>] [-d <delta file>] [-m <model image>] [-- SCIP args]\n"
+            "       %s -S -P [-q] [-o <log file>] [-z] [-V <verbosity>] [-m <model image>] [-a <CPU list>] [-s] [-w <seconds between incumbents>] [-r <seconds between progress reports>] [-- SCIP args]\n", argv[0], argv[0], argv[0]);
         return 1;
     }
 
     const char *logFileName = NULL;
+    const char *deltaFileName = NULL;
+    const char *checkpointFileName = NULL;
+    double checkpointInterval = 60;
     bool usePort = false;
+    bool quiet = false;
     bool haveInitialBestVal = false;
     double initialBestVal = 0;
+    int numThreads = 1;
+    bool server = false;
+    const char *verbosity = NULL;
+    const char *imageFileName = NULL;
+    const char *cpuList = NULL;
+    int estimateCores = 0;
+
+    // Stubs come first, more than one are solved in this process
+    std::vector<const char *> stubs;
+    char **p = argv + 1;
+    for (; *p && **p != '-'; ++p)
+    {
+        stubs.push_back(*p);
+    }
 
-    char **p = argv;
     for (; *p && strcmp(*p, "--"); ++p)
     {
         if (!strcmp(*p, "-b"))
@@ -96,8 +936,14 @@ int main(int argc, char **argv)
         {
             usePort = true;
         }
+        if (!strcmp(*p, "-P"))
+        {
+            usePort = true;
+            g_portInterface.setProtocol(2);
+        }
         if (!strcmp(*p, "-q"))
         {
+            quiet = true;
             g_portInterface.setQuiet(true);
         }
         if (!strcmp(*p, "-o"))
@@ -105,6 +951,161 @@ int main(int argc, char **argv)
             logFileName = *(p + 1);
             ++p;
         }
+        if (!strcmp(*p, "-d"))
+        {
+            deltaFileName = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-w"))
+        {
+            g_portInterface.setPublishInterval(atof(*(p + 1)));
+            ++p;
+        }
+        if (!strcmp(*p, "-r"))
+        {
+            g_portInterface.setProgressInterval(atof(*(p + 1)));
+            ++p;
+        }
+        if (!strcmp(*p, "-j"))
+        {
+            numThreads = atoi(*(p + 1));
+            ++p;
+        }
+        if (!strcmp(*p, "-c"))
+        {
+            checkpointFileName = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-C"))
+        {
+            checkpointInterval = atof(*(p + 1));
+            ++p;
+        }
+        if (!strcmp(*p, "-m"))
+        {
+            imageFileName = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-z"))
+        {
+            s_compressLog = true;
+        }
+        if (!strcmp(*p, "-V"))
+        {
+            verbosity = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-S"))
+        {
+            server = true;
+            g_portInterface.setServer(true);
+        }
+        if (!strcmp(*p, "-a"))
+        {
+            cpuList = *(p + 1);
+            ++p;
+        }
+        if (!strcmp(*p, "-s"))
+        {
+            g_portInterface.setSendStats(true);
+        }
+        if (!strcmp(*p, "-E"))
+        {
+            estimateCores = atoi(*(p + 1));
+            ++p;
+        }
+    }
+
+    // Before any thread is started, so the port and solver threads inherit it
+    std::vector<int> cpus;
+    if (cpuList != NULL)
+    {
+        if (!parseCpuList(cpuList, cpus))
+        {
+            fprintf(stderr, "Bad CPU list %s\n", cpuList);
+            return 1;
+        }
+        setThreadAffinity(cpus);
+    }
+
+    // Mapped for the whole process, its pages are shared with the other ports
+    if (imageFileName != NULL)
+    {
+        s_image = new ModelImage;
+        if (!s_image->map(imageFileName))
+        {
+            return 1;
+        }
+    }
+
+    if (server)
+    {
+        if (!usePort || !stubs.empty())
+        {
+            fprintf(stderr, "Server mode gets its stubs as jobs through the port\n");
+            return 1;
+        }
+        if (*p)
+        {
+            ++p;
+        }
+        std::ofstream f("scip.set");
+        writeVerbosity(f, verbosity);
+        for (; *p; ++p)
+        {
+            f << *p << std::endl;
+        }
+        f.close();
+        g_portInterface.initialize(usePort);
+        return serve(logFileName);
+    }
+
+    if (stubs.empty() || numThreads < 1
+        || (deltaFileName != NULL && stubs.size() > 1))
+    {
+        fprintf(stderr, "Expected one stub with -d, at least one without it and at least one thread\n");
+        return 1;
+    }
+
+    std::vector<Subproblem> subproblems(stubs.size());
+    for (size_t i = 0; i < stubs.size(); ++i)
+    {
+        if (!makeSubproblem(stubs[i], deltaFileName, subproblems[i]))
+        {
+            return 1;
+        }
+    }
+
+    // A checkpoint left by an earlier run replaces the stubs by its nodes
+    Checkpoint resumed;
+    if (checkpointFileName != NULL
+        && readCheckpoint(checkpointFileName, resumed))
+    {
+        fprintf(stderr, ">>> Resuming %lu open nodes from %s\n",
+            resumed.nodes.size(), checkpointFileName);
+        subproblems.clear();
+        for (size_t i = 0; i < resumed.nodes.size(); ++i)
+        {
+            Subproblem subproblem;
+            subproblem.nlfile = resumed.nodes[i].nlfile;
+            subproblem.name = resumed.nodes[i].nlfile;
+            subproblem.solFileName = resumed.nodes[i].solFileName;
+            subproblem.bounds = resumed.nodes[i].bounds;
+            subproblems.push_back(subproblem);
+        }
+    }
+
+    // Solutions are only sent if all subproblems have the same variables
+    int numVars = -1;
+    for (size_t i = 0; i < subproblems.size(); ++i)
+    {
+        int n = numVarsNL(subproblems[i].nlfile);
+        numVars = i == 0 || n == numVars ? n : -1;
+    }
+    if (s_image != NULL && numVars != s_image->numVars())
+    {
+        fprintf(stderr, "The model image is not of the stubs given\n");
+        return 1;
     }
 
     if (*p)
@@ -112,24 +1113,81 @@ int main(int argc, char **argv)
         ++p;
     }
     std::ofstream f("scip.set");
+    writeVerbosity(f, verbosity);
     for (; *p; ++p)
     {
         f << *p << std::endl;
     }
+    f.close();
+
+    // Only advises on the split, the port isn't used
+    if (estimateCores > 0)
+    {
+        if (subproblems.size() != 1)
+        {
+            fprintf(stderr, "-E estimates one stub\n");
+            return 1;
+        }
+        return estimate(subproblems[0], logFileName, estimateCores) == SCIP_OKAY ? 0 : 1;
+    }
     
     if (haveInitialBestVal)
     {
         g_portInterface.setBestValue(initialBestVal, false);
     }
+    if (resumed.hasIncumbent)
+    {
+        g_portInterface.setBestValue(resumed.incumbent, false);
+    }
+    g_portInterface.setNumVars(numVars);
     g_portInterface.initialize(usePort);
 
-    SCIP_RETCODE retcode = run(argv[1], logFileName);
+    CheckpointWriter *checkpoint = NULL;
+    if (checkpointFileName != NULL)
+    {
+        checkpoint = new CheckpointWriter(checkpointFileName, checkpointInterval,
+            numThreads * CHECKPOINT_NODES_PER_SOLVER);
+        if (resumed.hasIncumbent)
+        {
+            checkpoint->setIncumbent(resumed.incumbent,
+                resumed.hasSolution ? resumed.nlfile : std::string(),
+                resumed.solFileName, resumed.x);
+        }
+    }
 
-    if (retcode != SCIP_OKAY)
+    RunResult result;
+    SolverPool pool(subproblems, logFileName, quiet, checkpoint);
+    // Workers share the process CPUs if there are fewer than threads
+    if ((int)cpus.size() >= numThreads)
+    {
+        pool.setWorkerCpus(cpus);
+    }
+    if (!pool.run(numThreads, result))
     {
-        SCIPprintError(retcode);
         return -1;
     }
 
+    // The incumbent found before the restart may be the best of all. It is
+    // optimal only if its solution can still be written.
+    if (resumed.hasIncumbent && isBetter(result.bestVal, resumed.incumbent))
+    {
+        result.bestVal = resumed.incumbent;
+        if (resumed.hasSolution && writeResumedSolution(resumed) == SCIP_OKAY)
+        {
+            if (result.status == "infeasible")
+            {
+                result.status = "optimal";
+            }
+        }
+        else
+        {
+            fprintf(stderr, ">>> No solution for the resumed incumbent %g\n",
+                resumed.incumbent);
+            result.status = "stopped";
+        }
+    }
+    g_portInterface.writeResult(result.status, result.bestVal);
+    delete checkpoint;
+
     return 0;
 }
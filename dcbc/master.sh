@@ -26,4 +26,5 @@ ARGS=[$(echo $ARGS | sed 's/ /, /g')]
 R=$(dirname $0)
 
 erl -pa $R/ebin -name master@$($R/my_ip.sh) -boot start_sasl -s dcbc_app -dcbc working_mode master \
-    -dcbc files "$FILES" -dcbc args "$ARGS"  -dcbc registry_node `cat $R/registry-node`
+    -dcbc files "$FILES" -dcbc args "$ARGS"  -dcbc registry_node `cat $R/registry-node` \
+    ${GAP:+-dcbc gap $GAP} ${SLOTS:+-dcbc slots $SLOTS}
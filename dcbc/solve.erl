@@ -7,6 +7,8 @@ main(Args) ->
     %{ok, State} = dcbc_master:init([Stubs]),
     %gen_server:enter_loop(dcbc_master, [], State).
     {SArgs, Stubs} = split_args(Args, []),
+    set_gap(os:getenv("GAP")),
+    set_slots(os:getenv("SLOTS")),
     pong = net_adm:ping('%%%REGISTRY%%%'),
     global:sync(),
     {ok, Pid} = dcbc_master:start_link(SArgs, Stubs),
@@ -16,6 +18,20 @@ main(Args) ->
             ok
     end.
 
+%% GAP=0.01 stops the solve at 1% relative gap
+set_gap(false) ->
+    ok;
+set_gap(Gap) ->
+    {ok, Tokens, _} = erl_scan:string(Gap ++ "."),
+    {ok, Value} = erl_parse:parse_term(Tokens),
+    application:set_env(dcbc, gap, Value).
+
+%% SLOTS=8 gives every solver 8 CPUs of a slave, e.g. for -j 8
+set_slots(false) ->
+    ok;
+set_slots(Slots) ->
+    application:set_env(dcbc, slots, list_to_integer(Slots)).
+
 split_args(["--" | Tail], SArgs) ->
     {SArgs, split_args2(Tail, [])};
 split_args([Arg | Tail], SArgs) ->
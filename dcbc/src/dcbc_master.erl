@@ -7,33 +7,190 @@
 -behaviour(gen_server).
 -export([init/1, handle_cast/2, handle_info/2, terminate/2]).
 
--record(state, {best_val = none, best_sol = {none, <<>>}, stubs, start_ts, solver_args}).
+%% The solve stops once the relative gap between best_val and the global
+%% dual bound is at most gap, stopping is set then
+-record(state, {best_val = none, best_sol = {none, <<>>}, best_x = {none, []},
+                stubs, start_ts, solver_args, idle = [], exporting = none,
+                gap = none, bound = none, stopping = false, slots = 1}).
 
--record(subp, {path, pid = none, status = none, slave_pid = none, ref = none}).
+%% Subproblems exported by solvers have their stub and delta in data,
+%% progress is the list of {Seconds, DualBound, Nodes, OpenNodes} reported,
+%% the latest first. bound is the LP bound nlmod -L wrote along with the stub.
+-record(subp, {path, pid = none, status = none, slave_pid = none, ref = none,
+               data = none, started = none, exportable = true, progress = [],
+               bound = none}).
 
 start_link(SolverArgs, FileNames) ->
     gen_server:start_link(?MODULE, [SolverArgs, FileNames], []).
 
 init([SolverArgs, FileNames]) ->
     gen_server:cast(self(), do_init),
-    {Pairs, _} = lists:mapfoldl(fun (Path, Id) -> {{Id, #subp{path = Path}}, Id + 1} end, 1, FileNames),
+    {Pairs, _} = lists:mapfoldl(fun (Path, Id) ->
+                                        {{Id, #subp{path = Path, bound = read_bound(Path)}}, Id + 1}
+                                end, 1, FileNames),
     Stubs = dict:from_list(Pairs),
-    {ok, #state{stubs = Stubs, solver_args = SolverArgs, start_ts = now()}}.
+    Gap = case application:get_env(dcbc, gap) of
+              {ok, G} -> G;
+              undefined -> none
+          end,
+    %% Slave slots (CPUs) taken by each solver, for multi-threaded solvers
+    Slots = case application:get_env(dcbc, slots) of
+                {ok, S} -> S;
+                undefined -> 1
+            end,
+    {ok, #state{stubs = Stubs, solver_args = SolverArgs, start_ts = now(), gap = Gap,
+                slots = Slots}}.
 
 handle_cast(do_init, State) ->
     {ok, Slaves} = dcbc_registry:lookup(slave),
     {noreply, initial_submit({State, Slaves})};
 handle_cast({best_val, Name, Val}, State) ->
-    {noreply, update_best(Name, Val, none, State)};
+    {noreply, check_gap(update_best(Name, Val, none, State))};
+handle_cast({best_sol, Name, Val, X}, State) ->
+    {noreply, check_gap(update_best_x(Name, Val, X, update_best(Name, Val, none, State)))};
+handle_cast({stats, Name, Stats}, State) ->
+    io:format("~.3f ~p port stats: ~s~n", [seconds_elapsed(State#state.start_ts), Name, Stats]),
+    {noreply, State};
+handle_cast({progress, Name, Bound, Nodes, Open}, State) ->
+    T = seconds_elapsed(State#state.start_ts),
+    io:format("~.3f ~p progress: bound=~p nodes=~p open=~p~n", [T, Name, Bound, Nodes, Open]),
+    Subp = dict:fetch(Name, State#state.stubs),
+    Progress = [{T, Bound, Nodes, Open} | Subp#subp.progress],
+    {noreply, check_gap(State#state{stubs = dict:store(Name, Subp#subp{progress = Progress},
+                                                       State#state.stubs)})};
 handle_cast({solver_done, Name, Status, Val, Sol, Log}, State0) ->
     io:format("~.3f ~p ~p, result=~p~n", [seconds_elapsed(State0#state.start_ts), Name, Status, Val]),
-    ok = file:write_file(integer_to_list(Name) ++ ".log", Log),
+    ok = file:write_file(integer_to_list(Name) ++ ".log.gz", Log),
+    write_progress(Name, dict:fetch(Name, State0#state.stubs)),
     State = update_best(Name, Val, Sol, State0),
     Subp = dict:fetch(Name, State#state.stubs),
     demonitor(Subp#subp.ref, [flush]),
     Subp1 = Subp#subp{status = Status, ref = none, pid = none, slave_pid = none},
-    State1 = State#state{stubs = dict:store(Name, Subp1, State#state.stubs)},
-    {noreply, submit_next_problem(State1, Subp#subp.slave_pid)}.
+    State1 = State#state{stubs = dict:store(Name, Subp1, State#state.stubs),
+                         exporting = export_done(Name, State#state.exporting)},
+    {noreply, submit_next_problem(check_gap(State1), Subp#subp.slave_pid)};
+handle_cast({exported_nodes, Name, _Deltas}, #state{stopping = true} = State) ->
+    %% Nodes cut off by the solver are within the gap as well
+    {noreply, State#state{exporting = export_done(Name, State#state.exporting)}};
+handle_cast({exported_nodes, Name, Deltas}, State0) ->
+    io:format("~.3f ~p exported ~p open nodes~n", [seconds_elapsed(State0#state.start_ts), Name, length(Deltas)]),
+    Subp = dict:fetch(Name, State0#state.stubs),
+    State = State0#state{exporting = none,
+                         stubs = dict:store(Name, Subp#subp{exportable = Deltas =/= []},
+                                            State0#state.stubs)},
+    Stub = proplists:get_value(stub, subp_data(Subp)),
+    Stubs = lists:foldl(
+              fun (Delta, Acc) ->
+                      dict:store(dict:size(Acc) + 1,
+                                 #subp{path = Subp#subp.path,
+                                       data = [{stub, Stub}, {delta, Delta}]}, Acc)
+              end, State#state.stubs, Deltas),
+    {noreply, request_nodes(submit_idle(State#state{stubs = Stubs}))}.
+
+%% The global dual bound is the least of the last bounds reported for the
+%% subproblems not solved yet, none while any of them has no bound
+global_bound(Stubs) ->
+    dict:fold(fun (_K, #subp{status = Status}, Acc)
+                    when Status =:= optimal; Status =:= infeasible; Acc =:= unknown ->
+                      Acc;
+                  (_K, #subp{progress = []}, _Acc) ->
+                      unknown;
+                  (_K, #subp{progress = [{_T, Bound, _Nodes, _Open} | _]}, Acc) ->
+                      min_bound(Bound, Acc)
+              end, none, Stubs).
+
+min_bound(Bound, none) ->
+    Bound;
+min_bound(Bound, Acc) ->
+    min(Bound, Acc).
+
+relative_gap(BestVal, Bound) ->
+    (BestVal - Bound) / max(abs(BestVal), 1.0e-10).
+
+check_gap(#state{stopping = true} = State) ->
+    State;
+check_gap(#state{best_val = none} = State) ->
+    State;
+check_gap(State) ->
+    case global_bound(State#state.stubs) of
+        unknown ->
+            State;
+        Bound0 ->
+            BestVal = State#state.best_val,
+            Bound = min_bound(BestVal, Bound0),
+            Gap = relative_gap(BestVal, Bound),
+            T = seconds_elapsed(State#state.start_ts),
+            State1 = case Bound =/= State#state.bound of
+                         true ->
+                             io:format("~.3f global bound: ~p, gap: ~.6f~n", [T, Bound, Gap]),
+                             State#state{bound = Bound};
+                         false ->
+                             State
+                     end,
+            case State#state.gap =/= none andalso Gap =< State#state.gap of
+                true ->
+                    io:format("~.3f gap ~.6f is within ~p, stopping~n", [T, Gap, State#state.gap]),
+                    stop_all(State1);
+                false ->
+                    State1
+            end
+    end.
+
+%% Running solvers are interrupted and the subproblems not started dropped
+stop_all(State) ->
+    broadcast(none, stop, State#state.stubs),
+    Stubs = dict:map(fun (_K, #subp{status = none} = Subp) -> Subp#subp{status = skipped};
+                         (_K, Subp) -> Subp
+                     end, State#state.stubs),
+    State#state{stubs = Stubs, stopping = true}.
+
+export_done(Name, Name) ->
+    none;
+export_done(_Name, Exporting) ->
+    Exporting.
+
+%% Slaves left without work get open nodes of the solver with the most of
+%% them, or the longest running one before any progress is reported
+request_nodes(#state{idle = []} = State) ->
+    State;
+request_nodes(#state{exporting = none, idle = Idle} = State) ->
+    Running = [{-open_nodes(Progress), Started, Name, Pid}
+               || {Name, #subp{status = running, exportable = true, pid = Pid,
+                               started = Started, progress = Progress}}
+                      <- dict:to_list(State#state.stubs)],
+    case lists:sort(Running) of
+        [] ->
+            State;
+        [{_, _, Name, Pid} | _] ->
+            gen_server:cast(Pid, {export_nodes, length(Idle)}),
+            State#state{exporting = Name}
+    end;
+request_nodes(State) ->
+    State.
+
+open_nodes([{_T, _Bound, _Nodes, Open} | _]) ->
+    Open;
+open_nodes([]) ->
+    0.
+
+%% The progress time series goes next to the log, oldest line first
+write_progress(_Name, #subp{progress = []}) ->
+    ok;
+write_progress(Name, #subp{progress = Progress}) ->
+    Lines = [io_lib:format("~.3f ~p ~p ~p~n", [T, Bound, Nodes, Open])
+             || {T, Bound, Nodes, Open} <- lists:reverse(Progress)],
+    ok = file:write_file(integer_to_list(Name) ++ ".progress", Lines).
+
+submit_idle(#state{idle = []} = State) ->
+    State;
+submit_idle(#state{idle = [SlavePid | Idle]} = State) ->
+    case find_next_problem(State#state.stubs) of
+        {none, _} ->
+            State;
+        {Name, _} ->
+            {State1, _Slaves} = submit_problem(Name, {State#state{idle = Idle}, [SlavePid]}),
+            submit_idle(State1)
+    end.
 
 initial_submit({State, []}) ->
     State;
@@ -45,30 +202,90 @@ initial_submit({State, Slaves}) ->
             initial_submit(submit_problem(Name, {State, Slaves}))
     end.
 
+%% Best bound first, subproblems without a bound go last in the order given
 find_next_problem(Stubs) ->
-    dict:fold(
-      fun (K, #subp{status = none}, {none, HasRunning}) -> {K, HasRunning};
-          (_K, #subp{status = running}, {Next, _}) -> {Next, true};
-          (_K, _V, A) -> A end, {none, false}, Stubs).
+    {Next, HasRunning} =
+        dict:fold(
+          fun (K, #subp{status = none, bound = B}, {none, HasRunning}) ->
+                  {{B, K}, HasRunning};
+              (K, #subp{status = none, bound = B}, {Next, HasRunning}) ->
+                  {min({B, K}, Next), HasRunning};
+              (_K, #subp{status = running}, {Next, _}) -> {Next, true};
+              (_K, _V, A) -> A end, {none, false}, Stubs),
+    case Next of
+        none -> {none, HasRunning};
+        {_B, K} -> {K, HasRunning}
+    end.
+
+%% nlmod -L writes the LP bound of stub_NNN.nl or .delta to stub_NNN.bound
+read_bound(Path) ->
+    case file:read_file(filename:rootname(Path) ++ ".bound") of
+        {ok, Data} ->
+            Text = string:strip(binary_to_list(Data), both, $\n),
+            case {string:to_float(Text), string:to_integer(Text)} of
+                {{Bound, _}, _} when is_float(Bound) -> Bound;
+                {_, {Bound, _}} when is_integer(Bound) -> Bound;
+                _ -> none
+            end;
+        {error, _} ->
+            none
+    end.
 
 submit_problem(_Name, {State, []}) ->
     {State, []};
 submit_problem(Name, {State, [SlavePid | Tail] = Slaves}) ->
     Subp = dict:fetch(Name, State#state.stubs),
-    {ok, Data} = file:read_file(Subp#subp.path),
-    case dcbc_slave:start_solver(SlavePid, Name,
-                                 [{best_val, State#state.best_val}, {stub, Data},
-                                  {solver_args, State#state.solver_args}]) of
+    case start_solver(SlavePid, Name,
+                      [{best_val, State#state.best_val},
+                       {best_sol, State#state.best_x},
+                       {solver_args, State#state.solver_args},
+                       {slots, State#state.slots}
+                       | subp_data(Subp)]) of
         {ok, SolverPid} ->
             io:format("~.3f ~p started: ~s~n", [seconds_elapsed(State#state.start_ts), Name, Subp#subp.path]),
             Ref = monitor(process, SolverPid),
-            Subp1 = Subp#subp{pid = SolverPid, slave_pid = SlavePid, ref = Ref, status = running},
+            Subp1 = Subp#subp{pid = SolverPid, slave_pid = SlavePid, ref = Ref, status = running,
+                              started = now()},
             {State#state{stubs = dict:store(Name, Subp1, State#state.stubs)}, Slaves};
         {error, _} ->
             io:format("Failed to start ~s as ~p~n", [Subp#subp.path, Name]),
             submit_problem(Name, {State, Tail})
     end.
 
+%% The stub (the base of a delta) goes by its MD5, the bytes only if the
+%% slave doesn't have them cached yet
+start_solver(SlavePid, Name, Args) ->
+    Stub = proplists:get_value(stub, Args),
+    Hash = lists:flatten([io_lib:format("~2.16.0b", [B]) || <<B>> <= erlang:md5(Stub)]),
+    HashArgs = [{stub_hash, Hash} | proplists:delete(stub, Args)],
+    case dcbc_slave:start_solver(SlavePid, Name, HashArgs) of
+        {error, {missing_stub, Hash}} ->
+            ok = dcbc_slave:put_stub(SlavePid, Hash, Stub),
+            dcbc_slave:start_solver(SlavePid, Name, HashArgs);
+        Result ->
+            Result
+    end.
+
+subp_data(#subp{data = none, path = Path}) ->
+    read_stub(Path);
+subp_data(#subp{data = Data}) ->
+    Data.
+
+%% A .delta subproblem is sent along with the base NL file it refers to
+read_stub(Path) ->
+    {ok, Data} = file:read_file(Path),
+    case filename:extension(Path) of
+        ".delta" ->
+            {ok, Base} = file:read_file(delta_base(Path, Data)),
+            [{stub, Base}, {delta, Data}];
+        _ ->
+            [{stub, Data}]
+    end.
+
+delta_base(Path, Delta) ->
+    [<<"base ", Name/binary>> | _] = binary:split(Delta, <<"\n">>),
+    filename:join(filename:dirname(Path), binary_to_list(Name)).
+
 update_best(Name, Val, Sol, #state{best_val = BV1, best_sol = {BV2, _BS}} = State) ->
     case {is_better_than(Val, BV1, minimize), is_better_than(Val, BV2, minimize), Sol} of %% NOTE: minimization
         {true, true, Sol} when Sol =/= none ->
@@ -86,6 +303,17 @@ update_best(Name, Val, Sol, #state{best_val = BV1, best_sol = {BV2, _BS}} = Stat
             State
     end.
 
+%% Keeps the sparse vector of the best incumbent streamed by the solvers and
+%% passes it on, solvers try it as a start for their heuristics
+update_best_x(Name, Val, X, #state{best_x = {BV, _}} = State) ->
+    case is_better_than(Val, BV, minimize) of %% NOTE: minimization
+        true ->
+            broadcast(Name, {update_best_sol, Val, X}, State#state.stubs),
+            State#state{best_x = {Val, X}};
+        false ->
+            State
+    end.
+
 seconds_elapsed({_, S0, Mu0}) ->
     {_, S, Mu} = now(),
     S - S0 + (Mu - Mu0) / 1000000.
@@ -104,8 +332,11 @@ is_better_than(_New, _Current, maximize) ->
     false.
 
 broadcast_best_val(Name, Val, Stubs) ->
+    broadcast(Name, {update_best_val, Val}, Stubs).
+
+broadcast(Name, Msg, Stubs) ->
     dict:map(fun (K, #subp{pid = Pid}) when (K =/= Name) and (Pid =/= none) ->
-                     gen_server:cast(Pid, {update_best_val, Val});
+                     gen_server:cast(Pid, Msg);
                  (_,_) ->
                      ok
              end, Stubs).
@@ -119,7 +350,8 @@ handle_info({'DOWN', Ref, process, _Pid, Reason}, State) ->
                      none, State#state.stubs),
     io:format("Solver crashed for subproblem ~p: ~p~n", [Name, Reason]),
     Subp1 = Subp#subp{pid = none, ref = none, slave_pid = none, status = crashed},
-    State1 = State#state{stubs = dict:store(Name, Subp1, State#state.stubs)},
+    State1 = State#state{stubs = dict:store(Name, Subp1, State#state.stubs),
+                         exporting = export_done(Name, State#state.exporting)},
     {noreply, submit_next_problem(State1, Subp#subp.slave_pid)}.
 
 terminate(_Reason, State) ->
@@ -132,12 +364,15 @@ submit_next_problem(State, SlavePid) ->
         {none, false} ->
             {BestVal, BestSol} = State#state.best_sol,
             ok = file:write_file("solution.sol", BestSol),
-            io:format("~.3f Done, best value = ~p, best value in solution = ~p~nsolution written to solution.sol~n",
-                      [seconds_elapsed(State#state.start_ts), State#state.best_val, BestVal]),
+            io:format("~.3f Done, best value = ~p, best value in solution = ~p, global bound = ~p~nsolution written to solution.sol~n",
+                      [seconds_elapsed(State#state.start_ts), State#state.best_val, BestVal,
+                       State#state.bound]),
             exit(normal),
             State;
+        {none, true} when State#state.stopping ->
+            State#state{idle = [SlavePid | State#state.idle]};
         {none, true} ->
-            State;
+            request_nodes(State#state{idle = [SlavePid | State#state.idle]});
         {Name, _} ->
             {State1, _Slaves} = submit_problem(Name, {State, [SlavePid]}),
             State1
@@ -2,9 +2,14 @@
 
 -module(dcbc_slave).
 
--export([start_link/1, start_solver/3]).
+-export([start_link/1, start_solver/3, put_stub/3]).
 
--record(state, {solvers = dict:new(), nfree}).
+%% Stubs received are kept by their MD5 for the solvers started later
+-define(CACHE_DIR, "stub_cache").
+
+%% A slot is a CPU id, free_cpus are the ones no solver runs on. The ports
+%% are pinned to their slots with -a when there are no more slots than CPUs.
+-record(state, {solvers = dict:new(), free_cpus, ncpu, pin}).
 
 -behavoir(gen_server).
 -export([init/1, handle_call/3, handle_info/2, terminate/2]).
@@ -19,22 +24,92 @@ init([Ncpu]) ->
                 {0, N} -> N;
                 {N, _} -> N
             end,
-    {ok, #state{nfree = NFree}}.
+    Pin = case erlang:system_info(logical_processors) of
+              unknown -> false;
+              NLogical -> NFree =< NLogical
+          end,
+    {ok, #state{free_cpus = lists:seq(0, NFree - 1), ncpu = NFree, pin = Pin}}.
 
 start_solver(Pid, Name, Args) ->
     gen_server:call(Pid, {start_solver, Name, Args}).
 
-handle_call({start_solver, _Name, _Args}, _From, #state{nfree = 0} = State) ->
-    {reply, {error, no_free_slots}, State};
-handle_call({start_solver, Name, Args}, {MasterPid, _Tag}, #state{nfree = NFree} = State) ->
-    {ok, ChildPid} = supervisor:start_child(dcbc_slave_sup, [Name, MasterPid, Args]),
-    monitor(process, ChildPid),
-    {reply, {ok, ChildPid}, State#state{nfree = NFree - 1,
-                                        solvers = dict:store(ChildPid, 1, State#state.solvers)}}.
+put_stub(Pid, Hash, Stub) ->
+    gen_server:call(Pid, {put_stub, Hash, Stub}, infinity).
+
+%% A multi-threaded solver asks for {slots, N}, the lowest free CPU ids so
+%% its threads stay close on the usual numbering of the cores. It gets the
+%% whole slave at most.
+handle_call({start_solver, Name, Args0}, {MasterPid, _Tag}, #state{free_cpus = Free} = State) ->
+    Slots = min(proplists:get_value(slots, Args0, 1), State#state.ncpu),
+    case {length(Free) >= Slots, resolve_stub(Args0)} of
+        {false, _} ->
+            {reply, {error, no_free_slots}, State};
+        {true, {ok, Args}} ->
+            {Cpus, Rest} = lists:split(Slots, lists:sort(Free)),
+            CpuArgs = case State#state.pin of
+                          true -> [{cpus, Cpus} | Args];
+                          false -> Args
+                      end,
+            {ok, ChildPid} = supervisor:start_child(dcbc_slave_sup, [Name, MasterPid, CpuArgs]),
+            monitor(process, ChildPid),
+            {reply, {ok, ChildPid}, State#state{free_cpus = Rest,
+                                                solvers = dict:store(ChildPid, Cpus, State#state.solvers)}};
+        {true, {missing, Hash}} ->
+            {reply, {error, {missing_stub, Hash}}, State}
+    end;
+handle_call({put_stub, Hash, Stub}, _From, State) ->
+    Path = cache_path(Hash),
+    ok = filelib:ensure_dir(Path),
+    Tmp = Path ++ ".tmp",
+    ok = file:write_file(Tmp, Stub),
+    ok = file:rename(Tmp, Path),
+    {ok, CbcPath} = application:get_env(cbc_path),
+    spawn(fun() -> make_image(CbcPath, Path) end),
+    {reply, ok, State}.
+
+%% The solvers of this node map the image of a cached stub instead of each
+%% parsing it. nlmod sits next to the solver and refuses nonlinear stubs,
+%% which are then read as before. Built apart from the slave, nlmod renames
+%% the image into place once written, so solvers started meanwhile read the
+%% stub.
+make_image(CbcPath, Path) ->
+    Nlmod = filename:join(filename:dirname(CbcPath), "nlmod"),
+    case filelib:is_regular(Nlmod) of
+        true ->
+            Port = open_port({spawn_executable, Nlmod}, [{args, ["-I", Path]},
+                                                         exit_status, stderr_to_stdout]),
+            wait_exit(Port);
+        false ->
+            ok
+    end.
+
+wait_exit(Port) ->
+    receive
+        {Port, {data, _}} -> wait_exit(Port);
+        {Port, {exit_status, Status}} -> Status
+    end.
+
+%% A stub sent by hash is replaced with the path of the cached file
+resolve_stub(Args) ->
+    case proplists:get_value(stub_hash, Args) of
+        undefined ->
+            {ok, Args};
+        Hash ->
+            Path = cache_path(Hash),
+            case filelib:is_regular(Path) of
+                true ->
+                    {ok, [{stub_file, filename:absname(Path)} | proplists:delete(stub_hash, Args)]};
+                false ->
+                    {missing, Hash}
+            end
+    end.
+
+cache_path(Hash) ->
+    filename:join(?CACHE_DIR, Hash ++ ".nl").
 
 handle_info({'DOWN', _Ref, process, Pid, _Reason}, State) ->
-    NCpu = dict:fetch(Pid, State#state.solvers),
-    {noreply, State#state{nfree = State#state.nfree + NCpu,
+    Cpus = dict:fetch(Pid, State#state.solvers),
+    {noreply, State#state{free_cpus = Cpus ++ State#state.free_cpus,
                          solvers = dict:erase(Pid, State#state.solvers)}}.
 
 terminate(_Reason, _State) ->
@@ -4,8 +4,10 @@
 
 -export([start_link/4]).
 
+-define(PROTOCOL, 2).
+
 -record(state, {solver_args, master, name, port = none, sol_incumbent = none,
-                sol_status = port_terminated}).
+                sol_status = port_terminated, cpus = []}).
 
 -behaviour(gen_server).
 -export([init/1, handle_cast/2, handle_info/2, terminate/2]).
@@ -15,29 +17,98 @@ start_link(CbcPath, Name, MasterPid, Args) ->
 
 init([CbcPath, Name, MasterPid, Args]) ->
     SolverArgs = proplists:get_value(solver_args, Args, []),
-    Stub = proplists:get_value(stub, Args),
+    Stub = case proplists:get_value(stub_file, Args) of
+               undefined -> proplists:get_value(stub, Args);
+               Path -> {file, Path}
+           end,
+    Delta = proplists:get_value(delta, Args, none),
     BestVal = proplists:get_value(best_val, Args),
-    gen_server:cast(self(), {do_init, CbcPath, Stub, BestVal}),
+    BestSol = proplists:get_value(best_sol, Args, {none, []}),
+    gen_server:cast(self(), {do_init, CbcPath, Stub, Delta, BestVal, BestSol}),
     monitor(process, MasterPid),
-    {ok, #state{solver_args = SolverArgs, master = MasterPid, name = Name}}.
+    {ok, #state{solver_args = SolverArgs, master = MasterPid, name = Name,
+                cpus = proplists:get_value(cpus, Args, [])}}.
 
-handle_cast({do_init, CbcPath, Stub, BestVal}, State) ->
-    ok = file:write_file(stub_filename(), Stub),
-    Args = make_port_args(BestVal, State#state.solver_args),
+handle_cast({do_init, CbcPath, Stub, Delta, BestVal, BestSol}, State) ->
+    Args = write_stub(Stub, Delta) ++ image_args(Stub) ++ cpu_args(State#state.cpus)
+        ++ make_port_args(BestVal, State#state.solver_args),
     io:format("Starting solver for ~p: ~s ~p~n", [State#state.name, CbcPath, Args]),
     process_flag(trap_exit, true),
-    Port = open_port({spawn_executable, CbcPath}, [{packet, 2}, nouse_stdio,
+    Port = open_port({spawn_executable, CbcPath}, [{packet, 4}, nouse_stdio,
                                                    binary, {args, Args}]),
+    send_best_sol(Port, BestSol),
     {noreply, State#state{port = Port}};
 handle_cast({update_best_val, Val}, #state{port = Port} = State) ->
     Port ! {self(), {command, <<1, Val/float>>}},
+    {noreply, State};
+handle_cast({update_best_sol, Val, X}, #state{port = Port} = State) ->
+    send_best_sol(Port, {Val, X}),
+    {noreply, State};
+handle_cast({export_nodes, Count}, #state{port = Port} = State) ->
+    Port ! {self(), {command, <<7, Count:32>>}},
+    {noreply, State};
+%% The solver stops as after a limit and still sends its result and solution
+handle_cast(stop, #state{port = Port} = State) ->
+    Port ! {self(), {command, <<12>>}},
     {noreply, State}.
 
+%% Same sparse encoding as the solutions the port sends, with type 6
+send_best_sol(_Port, {_Val, []}) ->
+    ok;
+send_best_sol(Port, {Val, X}) ->
+    Pairs = << <<I:32, V/float>> || {I, V} <- X >>,
+    Port ! {self(), {command, <<6, Val/float, (length(X)):32, Pairs/binary>>}},
+    ok.
+
+%% The port expands the delta to stub_filename(), so the .sol name is the same.
+%% A stub from the slave's cache gets a link of its own, the NL reader writes
+%% the .sol next to the stub or base it reads before the port renames it, so
+%% solvers sharing the cached file would take each other's solutions.
+write_stub({file, Path}, none) ->
+    link_stub(Path, stub_filename()),
+    [stub_filename()];
+write_stub({file, Path}, Delta) ->
+    link_stub(Path, base_filename()),
+    ok = file:write_file(delta_filename(), Delta),
+    [base_filename(), "-d", delta_filename()];
+write_stub(Stub, none) ->
+    ok = file:write_file(stub_filename(), Stub),
+    [stub_filename()];
+write_stub(Stub, Delta) ->
+    ok = file:write_file(base_filename(), Stub),
+    ok = file:write_file(delta_filename(), Delta),
+    [base_filename(), "-d", delta_filename()].
+
+link_stub(Path, Name) ->
+    case file:make_link(Path, Name) of
+        ok -> ok;
+        {error, _} -> {ok, _} = file:copy(Path, Name)
+    end.
+
+%% The slave makes an image next to a cached stub if the stub is linear
+image_args({file, Path}) ->
+    Image = filename:rootname(Path) ++ ".img",
+    case filelib:is_regular(Image) of
+        true -> ["-m", Image];
+        false -> []
+    end;
+image_args(_Stub) ->
+    [].
+
+%% The CPUs of the slots the slave gave this solver
+cpu_args([]) ->
+    [];
+cpu_args(Cpus) ->
+    ["-a", string:join([integer_to_list(C) || C <- Cpus], ",")].
+
+%% -P selects protocol 2: 4-byte frames and incumbents with solutions,
+%% -z streams the log gzipped, so only the compressed log reaches the master,
+%% -s sends the port statistics before the result
 make_port_args(none, SolverArgs) ->
-    [stub_filename(), "-q", "-p", "-o", log_filename(),
+    ["-q", "-P", "-z", "-s", "-o", log_filename(),
      "--" | SolverArgs];
 make_port_args(BestVal, SolverArgs) ->
-    [stub_filename(), "-q", "-p", "-o", log_filename(),
+    ["-q", "-P", "-z", "-s", "-o", log_filename(),
      "-b", float_to_list(BestVal), "--" | SolverArgs].
 
 handle_info({'DOWN', _Ref, process, _Pid, _Reason}, State) -> 
@@ -58,9 +129,23 @@ get_file_content(FileName) ->
         {error, _Reason} -> <<>>
     end.
 
+handle_port_msg({hello, ?PROTOCOL}, State) ->
+    State;
 handle_port_msg({best_val, Val}, State) ->
     gen_server:cast(State#state.master, {best_val, State#state.name, Val}),
     State;
+handle_port_msg({best_sol, Val, X}, State) ->
+    gen_server:cast(State#state.master, {best_sol, State#state.name, Val, X}),
+    State;
+handle_port_msg({progress, Bound, Nodes, Open}, State) ->
+    gen_server:cast(State#state.master, {progress, State#state.name, Bound, Nodes, Open}),
+    State;
+handle_port_msg({exported_nodes, Deltas}, State) ->
+    gen_server:cast(State#state.master, {exported_nodes, State#state.name, Deltas}),
+    State;
+handle_port_msg({stats, Stats}, State) ->
+    gen_server:cast(State#state.master, {stats, State#state.name, Stats}),
+    State;
 handle_port_msg({done, Val, "optimal"}, State) ->
     State#state{sol_incumbent = Val, sol_status = optimal};
 handle_port_msg({done, Val, "infeasible"}, State) ->
@@ -71,19 +156,48 @@ handle_port_msg({done, Val, "stopped"}, State) ->
 decode(<<2, BestVal/float, Status/binary>>) ->
     {done, BestVal, binary_to_list(Status)};
 decode(<<3, BestVal/float>>) ->
-    {best_val, BestVal}.
+    {best_val, BestVal};
+decode(<<4, Version>>) ->
+    {hello, Version};
+%% The solution is sparse, a list of {Index, Value} for the nonzeros
+decode(<<5, BestVal/float, Count:32, Pairs/binary>>) ->
+    X = [{I, V} || <<I:32, V/float>> <= Pairs],
+    Count = length(X),
+    {best_sol, BestVal, X};
+decode(<<8, Count:32, Rest/binary>>) ->
+    Deltas = decode_deltas(Rest),
+    Count = length(Deltas),
+    {exported_nodes, Deltas};
+decode(<<11, Bound/float, Nodes:64, Open:64>>) ->
+    {progress, Bound, Nodes, Open};
+decode(<<13, Stats/binary>>) ->
+    {stats, binary_to_list(Stats)}.
+
+decode_deltas(<<>>) ->
+    [];
+decode_deltas(<<Len:32, Delta:Len/binary, Rest/binary>>) ->
+    [Delta | decode_deltas(Rest)].
 
 terminate(_Reason, _State) ->
     file:delete(stub_filename()),
+    file:delete(base_filename()),
+    file:delete(delta_filename()),
     file:delete(sol_filename()),
     file:delete(log_filename()),
+    file:delete(log_filename() ++ ".tail"),
     ok.
 
 stub_filename() ->
     "stub" ++ pid_to_list(self()) ++ ".nl".
 
+base_filename() ->
+    "stub" ++ pid_to_list(self()) ++ ".base.nl".
+
+delta_filename() ->
+    "stub" ++ pid_to_list(self()) ++ ".delta".
+
 sol_filename() ->
     "stub" ++ pid_to_list(self()) ++ ".sol".
 
 log_filename() ->
-    "stub" ++ pid_to_list(self()) ++ ".log".
+    "stub" ++ pid_to_list(self()) ++ ".log.gz".
@@ -63,11 +63,21 @@ def main(tmpDir):
     if not args.input is None:
         stubs.extend(args.input.read().split())
     stubs.extend(args.file)
+    stubs = orderByBound(stubs)
 
     if not stubs:
         print 'No problem stubs specified'
         sys.exit(1)
 
+    stubExt = os.path.splitext(stubs[0])[1]
+    if [s for s in stubs if os.path.splitext(s)[1] != stubExt]:
+        print 'Can not mix .nl and .delta subproblems'
+        sys.exit(1)
+    bases = set(deltaBase(s) for s in stubs if stubExt == '.delta')
+    if len(bases) > 1:
+        print 'All .delta subproblems should have the same base'
+        sys.exit(1)
+
     # if not args.resources:
     #     print 'No resources specified'
     #     sys.exit(1)
@@ -91,34 +101,54 @@ def main(tmpDir):
         paramsFiles.append(makeName('params.txt'))
 
     inputFiles = ['run-task.sh', 'task.py', 'port_proxy.py']
+    base = bases.pop() if bases else None
+    baseArg = ''
+    if base:
+        inputFiles.append('base.nl')
+        baseArg = ' base.nl'
     if args.solver == 'scip_bundle':
         inputFiles.append('scip_port')
         solver = './scip_port'
     else:
         solver = '%s_port' % args.solver
 
+    # scip_port resumes a preempted task from the checkpoint of its stub,
+    # carried out with the results and back in with the next run
+    useCheckpoints = 'scip' in args.solver
     stubNames = OrderedDict()
+    checkpoints = OrderedDict()
     paramNames = OrderedDict()
     with ZipFile(makeName('.zip'), 'w', ZIP_DEFLATED) as z:
         for f in inputFiles:
-            z.write(os.path.join(d, f), f)
+            if f == 'base.nl':
+                z.write(base, f)
+            else:
+                z.write(os.path.join(d, f), f)
         for i, stub in enumerate(stubs):
             stubNames['stub%d' % i] = os.path.basename(stub)
-            z.write(stub, 'stub%d.nl' % i)
+            checkpoints['stub%d' % i] = checkpointName(stub)
+            z.write(stub, 'stub%d%s' % (i, stubExt))
+            if useCheckpoints:
+                if os.path.exists(checkpointName(stub)):
+                    z.write(checkpointName(stub), 'stub%d.checkpoint' % i)
+                else:
+                    z.writestr('stub%d.checkpoint' % i, '')
         for i, params in enumerate(paramsFiles):
             paramNames[i] = os.path.basename(params)
             z.write(params, 'params%d.txt' % i)
 
+    checkpointFile = ' stub${n}.checkpoint' if useCheckpoints else ''
     with open(makeName('.plan'), 'wb') as f:
         f.write('parameter n from 0 to %d step 1\n' % (len(stubs) - 1))
         f.write('parameter p from 0 to %d step 1\n' % (len(paramsFiles) - 1))
-        f.write('input_files stub${n}.nl params${p}.txt %s\n' % ' '.join(inputFiles))
-        f.write('command bash run-task.sh %s stub${n}.nl %d params${p}.txt %g\n' % (
-            solver, args.stop_mode, args.initial_incumbent))
-        f.write('output_files stub${n}.sol stderr stdout.tgz\n')
+        f.write('input_files stub${n}%s%s params${p}.txt %s\n' % (
+            stubExt, checkpointFile, ' '.join(inputFiles)))
+        f.write('command bash run-task.sh %s stub${n}%s %d params${p}.txt %g%s\n' % (
+            solver, stubExt, args.stop_mode, args.initial_incumbent, baseArg))
+        f.write('output_files stub${n}.sol stub${n}.progress%s stderr stdout.tgz\n' % checkpointFile)
 
     if not args.use_results is None:
-        tasksRes = saveResults(args.use_results, stubNames, paramNames, args)
+        tasksRes = saveResults(args.use_results, stubNames, checkpoints, paramNames, args)
         if args.get_log:
             parseJobLog(args.out_prefix + '.log', tasksRes, args)
         return
@@ -141,7 +171,8 @@ def main(tmpDir):
             if 'result' in result:
                 print 'Result downloaded'
                 session.getFile(result['result']['results'], makeName('-results.zip'))
-                tasksRes = saveResults(makeName('-results.zip'), stubNames, paramNames, args)
+                tasksRes = saveResults(makeName('-results.zip'), stubNames, checkpoints,
+                                       paramNames, args)
                 if args.get_log:
                     print "Downloading job's log..."
                     session.getJobLog(jobId, args.out_prefix + '.log')
@@ -177,6 +208,27 @@ def main(tmpDir):
     finally:
         session.close()
 
+def orderByBound(stubs):
+    """Puts the stubs best LP bound first if nlmod -L wrote stub_NNN.bound
+    files for all of them, tasks are started in the plan order"""
+    bounds = []
+    for stub in stubs:
+        try:
+            with open(os.path.splitext(stub)[0] + '.bound') as f:
+                bounds.append(float(f.read()))
+        except (IOError, ValueError):
+            return stubs
+    return [s for b, i, s in sorted(zip(bounds, range(len(stubs)), stubs))]
+
+def checkpointName(stub):
+    return os.path.splitext(stub)[0] + '.checkpoint'
+
+def deltaBase(stub):
+    with open(stub, 'r') as f:
+        kind, name = f.readline().split()
+    assert(kind == 'base')
+    return os.path.join(os.path.dirname(stub), name)
+
 def parseJobLog(logFile, tasksRes, args):
     tasksRaw = sorted(parseFile(logFile)['tasks'].items())
     taskTimes = defaultdict(list)
@@ -239,11 +291,30 @@ def parseFile(fileName):
                         result['tasks'][m.group(1)]['resourceId'] = mm.group(1)
     return result
 
-def saveResults(jobResults, stubNames, paramNames, args):
+def saveResults(jobResults, stubNames, checkpoints, paramNames, args):
     OTHER_FIELDS = ['hostname', 'solver_exitcode']
     jobs = defaultdict(dict)
+    progress = []
     with ZipFile(jobResults, 'r') as z:
         for x in z.namelist():
+            if 'stub' in x and x.endswith('.progress'):
+                # Task directory and stub, the series of every task is kept
+                stubId = os.path.splitext(x.split('/')[-1])[0]
+                series = z.read(x)
+                if series:
+                    progress.append(('%s/%s.progress' % (x.split('/')[0],
+                        os.path.splitext(stubNames[stubId])[0]), series))
+                continue
+            if 'stub' in x and x.endswith('.checkpoint'):
+                # Empty once the task completed, nothing to resume then
+                stubId = os.path.splitext(x.split('/')[-1])[0]
+                checkpoint = z.read(x)
+                if checkpoint:
+                    with open(checkpoints[stubId], 'wb') as f:
+                        f.write(checkpoint)
+                elif os.path.exists(checkpoints[stubId]):
+                    os.remove(checkpoints[stubId])
+                continue
             if 'stub' in x:
                 jobId = x.split('/')[0]
                 stubId = os.path.splitext(x.split('/')[-1])[0]
@@ -294,6 +365,11 @@ def saveResults(jobResults, stubNames, paramNames, args):
                 jobs[jobId]['val'] = min(incumbents)
                 jobs[jobId]['status'] = 'failed'
 
+    if progress:
+        with ZipFile(args.out_prefix + '-progress.zip', 'w', ZIP_DEFLATED) as z:
+            for name, series in progress:
+                z.writestr(name, series)
+
     if not jobs:
         print 'No incumbents or solutions in job results'
         return jobs
@@ -323,7 +399,7 @@ def saveResults(jobResults, stubNames, paramNames, args):
             info['status'] = best['status']
             info['has_solution'] = True
             infos.append(info)
-            outName = stubName.replace('.nl', '.sol')
+            outName = os.path.splitext(stubName)[0] + '.sol'
             print 'Saving solution %s (%s) for task %d with incumbent %f' % (
                 outName, best['status'], info['taskNum'], best['val'])
             z.writestr(outName, best['sol'])
@@ -42,12 +42,14 @@ for p in subproblems:
 if os.path.isfile('subproblems.zip'):
     with closing(ZipFile('subproblems.zip', 'r')) as z:
         for x in z.namelist():
-            if not x.endswith('.nl') or '/' in x or '\\' in x:
+            if not os.path.splitext(x)[1] in ['.nl', '.delta'] or '/' in x or '\\' in x:
                 continue
             n = os.path.join('inputs', x)
             with open(n, 'w') as f:
                 f.write(z.read(x))
-            inputs.append(n)
+            # bases of .delta subproblems are not subproblems themselves
+            if not x.endswith('-base.nl'):
+                inputs.append(n)
 
 with open('inputs.txt', 'w') as f:
     for i in inputs:
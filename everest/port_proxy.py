@@ -17,15 +17,36 @@ def readExact(fd, l):
         bufs.append(buf)
     return ''.join(bufs)
 
-def sendIncumbent((_, fd, cpid), value):
-    msg = struct.pack('>HBd', 9, 1, value)
+# Protocol 2 ports are started with -P and frame messages with 4-byte lengths
+def lengthFormat(protocol):
+    return '>H' if protocol < 2 else '>I'
+
+def sendIncumbent((_, fd, cpid, protocol), value):
+    msg = struct.pack(lengthFormat(protocol) + 'Bd', 9, 1, value)
     wr = os.write(fd, msg)
     #assert(wr == len(msg))
 
-def stopSolver((_, fd, cpid)):
-    os.kill(cpid, signal.SIGINT)
+def sendSolution((_, fd, cpid, protocol), value, pairs):
+    assert protocol >= 2
+    body = struct.pack('>BdI', 6, value, len(pairs)) + \
+        ''.join(struct.pack('>Id', i, x) for i, x in pairs)
+    os.write(fd, struct.pack(lengthFormat(protocol), len(body)) + body)
+
+# A job for scip_port -S: text lines "stub <path>", "delta <path>",
+# "best <value>", "set <SCIP parameter line>"
+def sendJob((_, fd, cpid, protocol), jobId, text):
+    assert protocol >= 2
+    body = struct.pack('>BI', 9, jobId) + text
+    os.write(fd, struct.pack(lengthFormat(protocol), len(body)) + body)
+
+# <<12>> makes the port stop the solve as after a limit, the result and the
+# solution still come. The ports ignore SIGINT until the solve starts.
+def stopSolver((_, fd, cpid, protocol)):
+    msg = struct.pack(lengthFormat(protocol) + 'B', 1, 12)
+    os.write(fd, msg)
 
 def startSolver(args):
+    protocol = 2 if '-P' in args else 1
     solver2proxyRead, solver2proxyWrite = os.pipe()
     proxy2solverRead, proxy2solverWrite = os.pipe()
     old = signal.signal(signal.SIGINT, signal.SIG_IGN)
@@ -40,18 +61,38 @@ def startSolver(args):
     signal.signal(signal.SIGINT, old)
     os.close(solver2proxyWrite)
     os.close(proxy2solverRead)
-    return (solver2proxyRead, proxy2solverWrite, cpid)
+    return (solver2proxyRead, proxy2solverWrite, cpid, protocol)
 
-def readFromSolver((solver2proxyRead, _, cpid)):
-    buf = readExact(solver2proxyRead, 3)
+def readFromSolver((solver2proxyRead, _, cpid, protocol)):
+    fmt = lengthFormat(protocol) + 'B'
+    buf = readExact(solver2proxyRead, struct.calcsize(fmt))
     if not buf:
         p, exitcode = os.waitpid(cpid, 0)
         return 'closed', exitcode
-    bodyLen, msgType = struct.unpack('>HB', buf)
+    bodyLen, msgType = struct.unpack(fmt, buf)
     buf = readExact(solver2proxyRead, bodyLen-1)
-    if msgType == 3:
+    if msgType == 4:
+        version, = struct.unpack('>B', buf)
+        return 'hello', version
+    elif msgType == 5:
+        # Sparse solution: (index, value) pairs of the nonzeros
+        incumbent, count = struct.unpack('>dI', buf[:12])
+        pairs = [struct.unpack('>Id', buf[12 + 12 * i:24 + 12 * i])
+                 for i in xrange(count)]
+        return 'solution', incumbent, pairs
+    elif msgType == 3:
         incumbent, = struct.unpack('>d', buf)
         return 'incumbent', incumbent
+    elif msgType == 11:
+        bound, nodes, openNodes = struct.unpack('>dQQ', buf)
+        return 'progress', bound, nodes, openNodes
+    elif msgType == 10:
+        statusLen = bodyLen - 13
+        jobId, incumbent, status = struct.unpack('>Id%ds' % statusLen, buf)
+        return 'job_result', jobId, incumbent, status
+    elif msgType == 13:
+        # JSON counters of the port, sent before the result with -s
+        return 'stats', buf
     elif msgType == 2:
         statusLen = bodyLen - 9
         incumbent, status = struct.unpack('>d%ds' % statusLen, buf)
@@ -59,7 +100,7 @@ def readFromSolver((solver2proxyRead, _, cpid)):
 
 def main():
     solver = startSolver(['../c_src/cbc_port', '../test/BalanceTestDyn.nl',
-                          '-p'])#, '-q', '-o', 'test.log'])
+                          '-P'])#, '-q', '-o', 'test.log'])
 
     sendIncumbent(solver, 4.0)
 
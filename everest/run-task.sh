@@ -5,5 +5,8 @@ chmod +x $1 2>/dev/null
 cat /proc/meminfo
 python -u task.py $*
 RET=$?
+# scip_port removes its checkpoint once done and a task stopped early has
+# no progress, the plan still expects both
+touch ${2%.*}.checkpoint ${2%.*}.progress
 tar czf stdout.tgz stdout
 exit $RET
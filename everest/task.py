@@ -66,7 +66,10 @@ class Task:
         self.stopMode = int(sys.argv[3])
         paramsFile = sys.argv[4]
         initialIncumbent = float(sys.argv[5])
-        args = [solver, stub, '-p']
+        if len(sys.argv) > 6:
+            args = [solver, sys.argv[6], '-P', '-d', stub]
+        else:
+            args = [solver, stub, '-P']
         # time.sleep(random.uniform(1, 10))
 
         self.stoppedVar = os.path.splitext(stub)[0] + '_stopped'
@@ -88,6 +91,10 @@ class Task:
             args.append('-b')
             args.append('%g' % initialIncumbent)
 
+        # A preempted scip_port resumes from the open nodes it saved last
+        if 'scip' in os.path.basename(solver):
+            args.extend(['-c', os.path.splitext(stub)[0] + '.checkpoint'])
+
         with open(paramsFile, 'r') as f:
             otherArgs = f.read().split('\n')
         if otherArgs:
@@ -101,26 +108,45 @@ class Task:
         receiver.start()
 
         hadSmth = False
+        solution = None
+        startTime = time.time()
+        progressVar = os.path.splitext(stub)[0] + '_progress'
+        progressFile = open(os.path.splitext(stub)[0] + '.progress', 'w')
         while self.running:
             solverMsg = port_proxy.readFromSolver(self.solver)
-            if solverMsg[0] in ['incumbent', 'result']:
+            if solverMsg[0] in ['incumbent', 'solution', 'result']:
                 hadSmth = True
                 print "Found new record: %f" % solverMsg[1]
                 msg = "VAR_SET_MD record %f" % solverMsg[1]
                 self.send_message(msg)
+                if solverMsg[0] == 'solution':
+                    solution = solverMsg[2]
                 if solverMsg[0] == 'result':
-                    with open(os.path.splitext(stub)[0] + '.sol', 'r') as f:
-                        firstLine = f.readline()
-                    sys.stderr.write(">>> solutionHeader: %s\n" % firstLine)
+                    if solution is not None:
+                        sys.stderr.write(">>> solution: %d nonzeros\n" % len(solution))
+                    else:
+                        with open(os.path.splitext(stub)[0] + '.sol', 'r') as f:
+                            firstLine = f.readline()
+                        sys.stderr.write(">>> solutionHeader: %s\n" % firstLine)
                 if self.stopMode and solverMsg[0] == 'result':
                     print 'Got result, stopping other solvers...'
                     self.send_message('VAR_SET_MD %s 1' % self.stoppedVar)
+            elif solverMsg[0] == 'progress':
+                # Time series next to the solution, the latest also goes to
+                # the agent for scheduling
+                _, bound, nodes, openNodes = solverMsg
+                progressFile.write('%.3f %r %d %d\n' % (
+                    time.time() - startTime, bound, nodes, openNodes))
+                progressFile.flush()
+                self.send_message('VAR_SET_MD %s %r,%d,%d' % (
+                    progressVar, bound, nodes, openNodes))
             elif solverMsg[0] == 'closed':
                 if not hadSmth:
                     print 'Warning: No data from solver received'
                 self.running = False
                 self.sock.shutdown(socket.SHUT_WR)
                 receiver.join()
+                progressFile.close()
                 sys.stderr.write(">>> solver_exitcode: %s\n" % solverMsg[1])
                 print 'Finished', solverMsg
                 return solverMsg[1]
@@ -0,0 +1,162 @@
+#!/usr/bin/env python2.7
+"""
+End-to-end benchmark of the decomposition.
+
+Every instance is split by nlmod into 2^depth subproblems for each depth,
+and the subproblems are solved by each port with each number of workers.
+Workers are port processes run at the same time on this host, incumbents are
+relayed between them like the master does. One JSON object per run is
+appended to the output file, tagged with the commit, so that files of
+different commits can be compared.
+"""
+import os
+import sys
+import glob
+import json
+import time
+import shutil
+import select
+import signal
+import argparse
+import tempfile
+import subprocess
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'everest'))
+import port_proxy
+
+R = os.path.dirname(os.path.abspath(__file__))
+
+def makeParser():
+    parser = argparse.ArgumentParser(formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    parser.add_argument('-d', '--depths', type=int, nargs='+', default=[0, 2, 4],
+                        help='split depths, 2^depth subproblems')
+    parser.add_argument('-s', '--solvers', nargs='+', default=['cbc', 'scip'],
+                        choices=['cbc', 'scip'])
+    parser.add_argument('-w', '--workers', type=int, nargs='+', default=[1, 2, 4],
+                        help='numbers of ports solving at the same time')
+    parser.add_argument('-a', '--solver-args', default=[], nargs='+',
+                        help='arguments passed to the ports after --')
+    parser.add_argument('-o', '--output', default='bench.jsonl',
+                        help='file the results are appended to')
+    parser.add_argument('-k', '--keep', action='store_true',
+                        help='keep the working directory')
+    parser.add_argument('instance', nargs='*', default=[os.path.join(R, 'BalanceTestDyn.nl')],
+                        help='NL files of MILP instances')
+    return parser
+
+def commit():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'], cwd=R).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+def split(instance, depth, workDir):
+    """Returns (base, delta) pairs of the subproblems, delta is None for the
+    whole instance"""
+    stub = os.path.join(workDir, os.path.basename(instance))
+    shutil.copy(instance, stub)
+    if depth == 0:
+        return [(stub, None)]
+    prefix = os.path.splitext(os.path.basename(stub))[0]
+    subprocess.check_call([os.path.join(R, '..', 'c_src', 'nlmod'), '-d', os.path.basename(stub),
+                           'auto', str(2 ** depth)], cwd=workDir)
+    base = os.path.join(workDir, prefix + '-base.nl')
+    return [(base, d) for d in sorted(glob.glob(os.path.join(workDir, prefix + '_*.delta')))]
+
+def portArgs(solver, subproblem, best, logFile, solverArgs):
+    base, delta = subproblem
+    port = os.path.join(R, '..', 'c_src', solver + '_port')
+    if delta is None:
+        args = [port, base]
+    elif solver == 'scip':
+        args = [port, delta]
+    else:
+        args = [port, base, '-d', delta]
+    args.extend(['-P', '-q', '-o', logFile, '-r', '1'])
+    if best is not None:
+        args.extend(['-b', '%r' % best])
+    if solverArgs:
+        args.append('--')
+        args.extend(solverArgs)
+    return args
+
+def solve(solver, subproblems, workers, solverArgs, workDir):
+    pending = list(subproblems)
+    running = {}
+    nodes = {}
+    res = {'nodes': 0, 'best': None, 'first_incumbent': None, 'best_incumbent': None,
+           'statuses': {}}
+    start = time.time()
+    while pending or running:
+        while pending and len(running) < workers:
+            logFile = os.path.join(workDir, '%s-%d.log' % (solver, len(subproblems) - len(pending)))
+            p = port_proxy.startSolver(portArgs(solver, pending.pop(0), res['best'], logFile,
+                                                solverArgs))
+            running[p[0]] = p
+        ready, _, _ = select.select(running.keys(), [], [])
+        for fd in ready:
+            p = running[fd]
+            msg = port_proxy.readFromSolver(p)
+            if msg is None:
+                continue
+            if msg[0] in ['incumbent', 'solution'] or (msg[0] == 'result' and msg[2] == 'optimal'):
+                value = msg[1]
+                if res['best'] is None or value < res['best']:
+                    elapsed = time.time() - start
+                    res['best'] = value
+                    res['best_incumbent'] = elapsed
+                    if res['first_incumbent'] is None:
+                        res['first_incumbent'] = elapsed
+                    for other in running.values():
+                        if other is not p:
+                            try:
+                                port_proxy.sendIncumbent(other, value)
+                            except OSError:
+                                # Finished, its 'closed' is still to come
+                                pass
+            if msg[0] == 'progress':
+                nodes[fd] = msg[2]
+            elif msg[0] == 'result':
+                res['statuses'][msg[2]] = res['statuses'].get(msg[2], 0) + 1
+            elif msg[0] == 'closed':
+                res['nodes'] += nodes.pop(fd, 0)
+                os.close(fd)
+                os.close(p[1])
+                del running[fd]
+    res['wall'] = time.time() - start
+    return res
+
+def main():
+    args = makeParser().parse_args()
+    signal.signal(signal.SIGPIPE, signal.SIG_IGN)
+    rev = commit()
+    with open(args.output, 'a') as out:
+        for instance in args.instance:
+            for depth in args.depths:
+                workDir = tempfile.mkdtemp(prefix='bench-')
+                try:
+                    subproblems = split(instance, depth, workDir)
+                    for solver in args.solvers:
+                        runs = []
+                        for workers in args.workers:
+                            res = solve(solver, subproblems, workers, args.solver_args, workDir)
+                            res.update({'commit': rev, 'instance': os.path.basename(instance),
+                                        'depth': depth, 'subproblems': len(subproblems),
+                                        'solver': solver, 'workers': workers})
+                            runs.append(res)
+                        # Speedup over the fewest workers per added worker
+                        ref = runs[0]
+                        for res in runs:
+                            res['efficiency'] = (ref['wall'] * ref['workers']) / (res['wall'] * res['workers'])
+                            out.write(json.dumps(res, sort_keys=True) + '\n')
+                            out.flush()
+                            print '%(instance)s depth=%(depth)d %(solver)s workers=%(workers)d: ' \
+                                '%(wall).2fs nodes=%(nodes)d best=%(best)s efficiency=%(efficiency).2f' % res
+                finally:
+                    if args.keep:
+                        print 'Working directory:', workDir
+                    else:
+                        shutil.rmtree(workDir)
+
+if __name__ == '__main__':
+    main()